@@ -0,0 +1,269 @@
+#include "capture.h"
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+    // PNG chunk checksum (CRC-32, polynomial 0xEDB88320)
+    uint32_t Crc32(const uint8_t *data, const size_t length, uint32_t crc = 0)
+    {
+        static const auto table = []
+        {
+            std::array<uint32_t, 256> values{};
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t value = i;
+                for (uint8_t bit = 0; bit < 8; bit++)
+                {
+                    value = value & 1 ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+                }
+                values[i] = value;
+            }
+            return values;
+        }();
+
+        crc = ~crc;
+        for (size_t i = 0; i < length; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    void AppendBigEndian(std::vector<uint8_t> &buffer, const uint32_t value)
+    {
+        buffer.push_back(value >> 24);
+        buffer.push_back(value >> 16);
+        buffer.push_back(value >> 8);
+        buffer.push_back(value);
+    }
+
+    void WritePngChunk(std::ostream &out, const char type[4], const std::vector<uint8_t> &data)
+    {
+        std::vector<uint8_t> chunk;
+        AppendBigEndian(chunk, data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        // The CRC covers the type and the data but not the length
+        AppendBigEndian(chunk, Crc32(chunk.data() + 4, chunk.size() - 4));
+        out.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+    }
+
+    // Chip 8 frames are tiny, so the image data goes into uncompressed deflate blocks instead of pulling in zlib
+    void WritePng(std::ostream &out, const std::vector<uint8_t> &pixels, const uint32_t width, const uint32_t height,
+                  const uint8_t channels)
+    {
+        constexpr uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        out.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+        std::vector<uint8_t> header;
+        AppendBigEndian(header, width);
+        AppendBigEndian(header, height);
+        // 8 bits per channel, grayscale (0) or RGB (2), default compression, filter and interlacing
+        header.insert(header.end(), {8, static_cast<uint8_t>(channels == 3 ? 2 : 0), 0, 0, 0});
+        WritePngChunk(out, "IHDR", header);
+
+        // Every scanline starts with filter type 0 (none)
+        const size_t stride = width * channels;
+        std::vector<uint8_t> raw;
+        raw.reserve((stride + 1) * height);
+        for (uint32_t row = 0; row < height; row++)
+        {
+            raw.push_back(0);
+            raw.insert(raw.end(), pixels.begin() + row * stride, pixels.begin() + (row + 1) * stride);
+        }
+
+        // zlib stream: header, stored blocks of at most 65535 bytes, Adler-32 of the raw data
+        std::vector<uint8_t> zlib = {0x78, 0x01};
+        size_t offset = 0;
+        do
+        {
+            const uint16_t length = std::min<size_t>(raw.size() - offset, 0xFFFF);
+            const bool last = offset + length == raw.size();
+            zlib.insert(zlib.end(), {static_cast<uint8_t>(last), static_cast<uint8_t>(length),
+                                     static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(~length),
+                                     static_cast<uint8_t>(~length >> 8)});
+            zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+            offset += length;
+        } while (offset < raw.size());
+
+        uint32_t a = 1;
+        uint32_t b = 0;
+        for (const uint8_t byte: raw)
+        {
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+        AppendBigEndian(zlib, (b << 16) | a);
+        WritePngChunk(out, "IDAT", zlib);
+        WritePngChunk(out, "IEND", {});
+    }
+
+    // Binary PBM: rows packed MSB first, 1 means black
+    void WritePbm(std::ostream &out, const std::vector<uint8_t> &pixels, const uint32_t width, const uint32_t height)
+    {
+        out << "P4\n" << width << " " << height << "\n";
+        std::vector<uint8_t> row((width + 7) / 8);
+        for (uint32_t y = 0; y < height; y++)
+        {
+            std::fill(row.begin(), row.end(), 0);
+            for (uint32_t x = 0; x < width; x++)
+            {
+                if (pixels[y * width + x] == 0)
+                {
+                    row[x / 8] |= 0b10000000 >> (x % 8);
+                }
+            }
+            out.write(reinterpret_cast<const char *>(row.data()), row.size());
+        }
+    }
+}
+
+FrameCapture::FrameCapture(const CaptureOptions &options) : options(options), width(64 * options.scale),
+                                                            height(32 * options.scale),
+                                                            channels(options.format == CaptureFormat::Png &&
+                                                                     options.rgb ? 3 : 1)
+{
+    if (options.format == CaptureFormat::Y4m)
+    {
+        if (options.output == "-")
+        {
+            stream = &std::cout;
+        }
+        else
+        {
+            file.open(options.output, std::ios::binary);
+            if (!file.is_open())
+            {
+                std::cerr << "Failed to open capture output" << std::endl;
+                exit(1);
+            }
+            stream = &file;
+        }
+        // Full-range luma with neutral 4:2:0 chroma (two planes of a quarter the luma size each)
+        neutralChroma.assign(width * height / 2, 0x80);
+        *stream << "YUV4MPEG2 W" << width << " H" << height << " F60:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n";
+    }
+    else
+    {
+        std::filesystem::create_directories(options.output);
+    }
+
+    writer = std::thread(&FrameCapture::WriterLoop, this);
+}
+
+FrameCapture::~FrameCapture()
+{
+    {
+        std::lock_guard lock(queueMutex);
+        closed = true;
+    }
+    queueNotEmpty.notify_one();
+    writer.join();
+    if (stream)
+    {
+        stream->flush();
+    }
+}
+
+void FrameCapture::Submit(const std::bitset<2048> &display)
+{
+    Frame frame{frameNumber++, {}};
+    // The very first frame is always converted, later ones only when the display changed
+    if (frame.number == 0 || display != lastDisplay)
+    {
+        ConvertFrame(display, frame.pixels);
+        lastDisplay = display;
+    }
+
+    std::unique_lock lock(queueMutex);
+    queueNotFull.wait(lock, [this] { return queue.size() < options.queueDepth; });
+    queue.push_back(std::move(frame));
+    lock.unlock();
+    queueNotEmpty.notify_one();
+}
+
+void FrameCapture::ConvertFrame(const std::bitset<2048> &display, std::vector<uint8_t> &pixels) const
+{
+    pixels.resize(width * height * channels);
+    const size_t stride = width * channels;
+    for (uint8_t i = 0; i < 32; i++)
+    {
+        // Build the first scaled row of this Chip 8 row, then copy it for the remaining scale - 1 rows
+        uint8_t *row = pixels.data() + i * options.scale * stride;
+        for (uint8_t j = 0; j < 64; j++)
+        {
+            const uint8_t value = display[i * 64 + j] ? 0xFF : 0x00;
+            std::fill_n(row + j * options.scale * channels, options.scale * channels, value);
+        }
+        for (uint8_t k = 1; k < options.scale; k++)
+        {
+            std::copy_n(row, stride, row + k * stride);
+        }
+    }
+}
+
+void FrameCapture::WriterLoop()
+{
+    while (true)
+    {
+        std::unique_lock lock(queueMutex);
+        queueNotEmpty.wait(lock, [this] { return closed || !queue.empty(); });
+        if (queue.empty())
+        {
+            return;
+        }
+        Frame frame = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        queueNotFull.notify_one();
+
+        WriteFrame(frame);
+    }
+}
+
+void FrameCapture::WriteFrame(const Frame &frame)
+{
+    const bool repeat = frame.pixels.empty();
+    if (!repeat)
+    {
+        lastPixels = frame.pixels;
+    }
+
+    if (options.format == CaptureFormat::Y4m)
+    {
+        // Y4M has a fixed frame rate, so unchanged frames are written again from the cached buffer
+        *stream << "FRAME\n";
+        stream->write(reinterpret_cast<const char *>(lastPixels.data()), lastPixels.size());
+        stream->write(reinterpret_cast<const char *>(neutralChroma.data()), neutralChroma.size());
+        return;
+    }
+
+    if (repeat)
+    {
+        return;
+    }
+
+    std::ostringstream path;
+    path << options.output << "/frame_" << std::setw(6) << std::setfill('0') << frame.number
+            << (options.format == CaptureFormat::Pbm ? ".pbm" : ".png");
+    std::ofstream image(path.str(), std::ios::binary);
+    if (!image.is_open())
+    {
+        std::cerr << "Failed to write " << path.str() << std::endl;
+        exit(1);
+    }
+
+    if (options.format == CaptureFormat::Pbm)
+    {
+        WritePbm(image, lastPixels, width, height);
+    }
+    else
+    {
+        WritePng(image, lastPixels, width, height, channels);
+    }
+}
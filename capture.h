@@ -0,0 +1,89 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <bitset>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class CaptureFormat
+{
+    // One 1-bit PBM image per changed frame
+    Pbm,
+    // One 8-bit grayscale or RGB PNG image per changed frame
+    Png,
+    // A single YUV4MPEG2 stream at 60 fps that ffmpeg can read from a pipe
+    Y4m,
+};
+
+typedef struct captureOptions
+{
+    CaptureFormat format = CaptureFormat::Y4m;
+    // Directory for image sequences, file for Y4M ("-" writes the stream to stdout)
+    std::string output;
+    // Each Chip 8 pixel becomes a scale x scale block
+    uint8_t scale = 1;
+    // Only affects PNG, PBM is 1-bit and Y4M stores luma
+    bool rgb = false;
+    // Frames the emulator may run ahead of the writer before Submit blocks
+    size_t queueDepth = 64;
+} CaptureOptions;
+
+// Converts frames on the emulator thread and encodes them on a background writer thread.
+// Frames whose display did not change are not converted again: image sequences skip them (the file numbers
+// keep counting, so gaps mean "hold previous frame") and Y4M repeats the previous frame to keep the frame rate.
+class FrameCapture
+{
+public:
+    explicit FrameCapture(const CaptureOptions &options);
+
+    // Flushes every queued frame and joins the writer
+    ~FrameCapture();
+
+    FrameCapture(const FrameCapture &) = delete;
+    FrameCapture &operator=(const FrameCapture &) = delete;
+
+    // Call once per emulated frame, blocks while the queue is full
+    void Submit(const std::bitset<2048> &display);
+
+private:
+    typedef struct frame
+    {
+        uint64_t number;
+        // Empty when the display is unchanged since the previous frame
+        std::vector<uint8_t> pixels;
+    } Frame;
+
+    void ConvertFrame(const std::bitset<2048> &display, std::vector<uint8_t> &pixels) const;
+
+    void WriterLoop();
+
+    void WriteFrame(const Frame &frame);
+
+    const CaptureOptions options;
+    const uint32_t width;
+    const uint32_t height;
+    const uint8_t channels;
+
+    std::bitset<2048> lastDisplay;
+    uint64_t frameNumber = 0;
+
+    std::mutex queueMutex;
+    std::condition_variable queueNotEmpty;
+    std::condition_variable queueNotFull;
+    std::deque<Frame> queue;
+    bool closed = false;
+
+    // Owned by the writer thread, stream points at file or std::cout
+    std::ofstream file;
+    std::ostream *stream = nullptr;
+    std::vector<uint8_t> lastPixels;
+    std::vector<uint8_t> neutralChroma;
+    std::thread writer;
+};
+
+#endif //CAPTURE_H
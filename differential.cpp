@@ -0,0 +1,295 @@
+#include "differential.h"
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <random>
+
+namespace
+{
+    // Executes instruction number `instruction` with the movie's keypad, ticking timers at frame boundaries.
+    // Returns false if the engine trapped.
+    bool Step(const Engine &engine, Chip8 &chip8, const uint64_t instruction, const DifferentialOptions &options)
+    {
+        std::bitset<16> keypad{};
+        if (!options.inputMovie.empty())
+        {
+            const uint64_t frame = instruction / options.instructionsPerFrame;
+            keypad = options.inputMovie[std::min<uint64_t>(frame, options.inputMovie.size() - 1)];
+        }
+
+        try
+        {
+            engine(chip8, keypad, options.params);
+        }
+        catch (const MemoryTrap &)
+        {
+            return false;
+        }
+
+        if ((instruction + 1) % options.instructionsPerFrame == 0)
+        {
+            DecrementTimers(chip8);
+        }
+        return true;
+    }
+
+    // Bisects [first, last] for the first instruction after which the engines disagree, given that they agree on
+    // the checkpoints (state before `first`) and disagree after `last`
+    Divergence Bisect(const Engine &reference, const Engine &candidate, const Chip8 &checkpoint, const uint64_t first,
+                      const uint64_t last, const DifferentialOptions &options)
+    {
+        // Replays both engines from the checkpoint up to and including instruction `until`
+        const auto replay = [&](const uint64_t until, Divergence &state)
+        {
+            state.reference = checkpoint;
+            state.candidate = checkpoint;
+            state.referenceTrapped = false;
+            state.candidateTrapped = false;
+            for (uint64_t i = first; i <= until; i++)
+            {
+                // Same guard as RunDifferential: an engine about to decode an unknown instruction would exit
+                if (!IsKnownInstruction(PeekOpcode(state.reference)) ||
+                    !IsKnownInstruction(PeekOpcode(state.candidate)))
+                {
+                    break;
+                }
+                state.before = state.reference;
+                state.referenceTrapped = !Step(reference, state.reference, i, options);
+                state.candidateTrapped = !Step(candidate, state.candidate, i, options);
+                if (state.referenceTrapped || state.candidateTrapped)
+                {
+                    break;
+                }
+            }
+            return state.referenceTrapped != state.candidateTrapped || !SameState(state.reference, state.candidate);
+        };
+
+        uint64_t low = first;
+        uint64_t high = last;
+        Divergence divergence{};
+        while (low < high)
+        {
+            const uint64_t middle = low + (high - low) / 2;
+            if (replay(middle, divergence))
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+        replay(low, divergence);
+        divergence.instruction = low;
+        return divergence;
+    }
+
+    void PrintState(std::ostream &out, const char *name, const Chip8 &state, const Chip8 &other, const bool trapped)
+    {
+        // Fields that differ from the other engine are marked with *
+        const auto mark = [](const bool differs) { return differs ? "*" : " "; };
+        out << std::hex << std::uppercase << std::setfill('0') << name << (trapped ? " (trapped)" : "") << "\n";
+        out << "  PC " << std::setw(3) << state.programCounter << mark(state.programCounter != other.programCounter)
+                << " I " << std::setw(3) << state.index << mark(state.index != other.index)
+                << " SP " << std::setw(2) << +state.sp << mark(state.sp != other.sp)
+                << " DT " << std::setw(2) << +state.delayTimer << mark(state.delayTimer != other.delayTimer)
+                << " ST " << std::setw(2) << +state.soundTimer << mark(state.soundTimer != other.soundTimer)
+                << " RNG " << std::setw(8) << state.randomState << mark(state.randomState != other.randomState)
+                << "\n  ";
+        for (uint8_t i = 0; i < 16; i++)
+        {
+            out << "V" << +i << " " << std::setw(2) << +state.registers[i]
+                    << mark(state.registers[i] != other.registers[i]) << (i == 7 ? "\n  " : " ");
+        }
+        out << "\n  Stack";
+        for (uint8_t i = 0; i < STACK_SIZE; i++)
+        {
+            out << " " << std::setw(3) << state.stack[i] << mark(state.stack[i] != other.stack[i]);
+        }
+        out << "\n";
+    }
+}
+
+uint64_t HashState(const Chip8 &chip8)
+{
+    // FNV-1a style mixing over 64-bit words, memory and display dominate the cost
+    uint64_t hash = 0xCBF29CE484222325;
+    const auto mix = [&hash](const uint64_t word) { hash = (hash ^ word) * 0x100000001B3; };
+
+    for (size_t i = 0; i < MEMORY_SIZE; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, chip8.memory + i, 8);
+        mix(word);
+    }
+    mix(std::hash<std::bitset<2048>>{}(chip8.display));
+    uint64_t stack[STACK_SIZE / 4];
+    std::memcpy(stack, chip8.stack, sizeof(chip8.stack));
+    uint64_t registers[2];
+    std::memcpy(registers, chip8.registers, sizeof(chip8.registers));
+    for (const uint64_t word: stack)
+    {
+        mix(word);
+    }
+    mix(registers[0]);
+    mix(registers[1]);
+    mix(static_cast<uint64_t>(chip8.programCounter) << 48 | static_cast<uint64_t>(chip8.index) << 32 |
+        chip8.randomState);
+    mix(chip8.sp | chip8.delayTimer << 8 | chip8.soundTimer << 16 | chip8.beginKeyPress << 24);
+    return hash;
+}
+
+bool SameState(const Chip8 &a, const Chip8 &b)
+{
+    return std::equal(a.memory, a.memory + MEMORY_SIZE, b.memory) && a.display == b.display &&
+           std::equal(a.stack, a.stack + STACK_SIZE, b.stack) && std::equal(a.registers, a.registers + 16, b.registers)
+           && a.programCounter == b.programCounter && a.index == b.index && a.sp == b.sp &&
+           a.delayTimer == b.delayTimer && a.soundTimer == b.soundTimer && a.beginKeyPress == b.beginKeyPress &&
+           a.randomState == b.randomState;
+}
+
+DifferentialResult RunDifferential(const Engine &reference, const Engine &candidate, const Chip8 &initial,
+                                   const DifferentialOptions &options)
+{
+    DifferentialResult result{};
+    Chip8 referenceState = initial;
+    SeedRandom(referenceState, options.seed);
+    Chip8 candidateState = referenceState;
+
+    // Last state both engines agreed on, and the index of the instruction that follows it
+    Chip8 checkpoint = referenceState;
+    uint64_t checkpointInstruction = 0;
+
+    for (uint64_t i = 0; i < options.maxInstructions; i++)
+    {
+        // The decoder exits the process on unknown instructions, so the run stops before either engine reaches one.
+        // Only one of them reaching one means their states already differ.
+        const bool referenceKnown = IsKnownInstruction(PeekOpcode(referenceState));
+        const bool candidateKnown = IsKnownInstruction(PeekOpcode(candidateState));
+        if (!referenceKnown || !candidateKnown)
+        {
+            if (i > checkpointInstruction &&
+                (referenceKnown != candidateKnown || HashState(referenceState) != HashState(candidateState)))
+            {
+                result.divergence = Bisect(reference, candidate, checkpoint, checkpointInstruction, i - 1, options);
+            }
+            else
+            {
+                result.halted = true;
+            }
+            break;
+        }
+
+        const bool referenceOk = Step(reference, referenceState, i, options);
+        const bool candidateOk = Step(candidate, candidateState, i, options);
+        result.instructionsExecuted = i + 1;
+
+        const bool lastInstruction = i + 1 == options.maxInstructions;
+        if (referenceOk && candidateOk && !lastInstruction && (i + 1) % options.hashInterval != 0)
+        {
+            continue;
+        }
+
+        if (referenceOk != candidateOk || HashState(referenceState) != HashState(candidateState))
+        {
+            result.divergence = Bisect(reference, candidate, checkpoint, checkpointInstruction, i, options);
+            break;
+        }
+        if (!referenceOk)
+        {
+            // Both trapped on the same instruction with the same state
+            result.halted = true;
+            break;
+        }
+        checkpoint = referenceState;
+        checkpointInstruction = i + 1;
+    }
+    return result;
+}
+
+void GenerateRandomProgram(Chip8 &chip8, const uint32_t seed)
+{
+    // Opcode templates: fixed bits and the bits filled at random
+    constexpr std::pair<uint16_t, uint16_t> templates[] = {
+        {0x00E0, 0x0000}, {0x00EE, 0x0000}, {0x1000, 0x0FFF}, {0x2000, 0x0FFF}, {0x3000, 0x0FFF},
+        {0x4000, 0x0FFF}, {0x5000, 0x0FF0}, {0x6000, 0x0FFF}, {0x7000, 0x0FFF}, {0x8000, 0x0FF0},
+        {0x8001, 0x0FF0}, {0x8002, 0x0FF0}, {0x8003, 0x0FF0}, {0x8004, 0x0FF0}, {0x8005, 0x0FF0},
+        {0x8006, 0x0FF0}, {0x8007, 0x0FF0}, {0x800E, 0x0FF0}, {0x9000, 0x0FF0}, {0xA000, 0x0FFF},
+        {0xB000, 0x0FFF}, {0xC000, 0x0FFF}, {0xD000, 0x0FFF}, {0xE09E, 0x0F00}, {0xE0A1, 0x0F00},
+        {0xF007, 0x0F00}, {0xF00A, 0x0F00}, {0xF015, 0x0F00}, {0xF018, 0x0F00}, {0xF01E, 0x0F00},
+        {0xF029, 0x0F00}, {0xF033, 0x0F00}, {0xF055, 0x0F00}, {0xF065, 0x0F00},
+    };
+
+    std::mt19937 random(seed);
+    for (size_t address = ROM_ADDRESS_START; address < MEMORY_SIZE; address += 2)
+    {
+        const auto &[fixed, variable] = templates[random() % std::size(templates)];
+        uint16_t opcode = fixed | (random() & variable);
+        // Keep jumps and calls inside the program and aligned, so that most of it actually runs
+        if (fixed == 0x1000 || fixed == 0x2000)
+        {
+            opcode = fixed | ((ROM_ADDRESS_START + random() % (MEMORY_SIZE - ROM_ADDRESS_START)) & 0xFFE);
+        }
+        chip8.memory[address] = opcode >> 8;
+        chip8.memory[address + 1] = opcode & 0xFF;
+    }
+    chip8.programCounter = ROM_ADDRESS_START;
+}
+
+uint32_t FuzzEngines(const Engine &reference, const Engine &candidate, const uint32_t firstSeed,
+                     const uint32_t programs, const DifferentialOptions &options, std::ostream &out)
+{
+    uint32_t diverged = 0;
+    for (uint32_t seed = firstSeed; seed < firstSeed + programs; seed++)
+    {
+        Chip8 chip8;
+        LoadFontsIntoMemory(chip8);
+        GenerateRandomProgram(chip8, seed);
+
+        // Random key presses held for a few frames each
+        DifferentialOptions programOptions = options;
+        programOptions.seed = seed;
+        std::mt19937 random(seed ^ 0x5EED);
+        const uint64_t frames = options.maxInstructions / options.instructionsPerFrame + 1;
+        programOptions.inputMovie.clear();
+        while (programOptions.inputMovie.size() < frames)
+        {
+            const std::bitset<16> keypad(random() % 4 == 0 ? 1 << random() % 16 : 0);
+            programOptions.inputMovie.insert(programOptions.inputMovie.end(), 1 + random() % 8, keypad);
+        }
+
+        const DifferentialResult result = RunDifferential(reference, candidate, chip8, programOptions);
+        if (result.divergence)
+        {
+            diverged++;
+            out << "Seed " << std::dec << seed << ": ";
+            PrintDivergence(out, *result.divergence);
+        }
+    }
+    return diverged;
+}
+
+void PrintDivergence(std::ostream &out, const Divergence &divergence)
+{
+    out << "Engines diverge at instruction " << std::dec << divergence.instruction << ", opcode " << std::hex
+            << std::uppercase << std::setfill('0') << std::setw(4) << PeekOpcode(divergence.before) << " at PC "
+            << std::setw(3) << divergence.before.programCounter << "\n";
+    PrintState(out, "Reference", divergence.reference, divergence.candidate, divergence.referenceTrapped);
+    PrintState(out, "Candidate", divergence.candidate, divergence.reference, divergence.candidateTrapped);
+
+    // Memory and display are only summarised, the registers usually tell the story
+    for (size_t i = 0; i < MEMORY_SIZE; i++)
+    {
+        if (divergence.reference.memory[i] != divergence.candidate.memory[i])
+        {
+            out << "  Memory " << std::setw(3) << i << ": " << std::setw(2) << +divergence.reference.memory[i]
+                    << " vs " << std::setw(2) << +divergence.candidate.memory[i] << "\n";
+        }
+    }
+    const size_t pixels = (divergence.reference.display ^ divergence.candidate.display).count();
+    if (pixels > 0)
+    {
+        out << "  Display differs in " << std::dec << pixels << " pixels\n";
+    }
+    out << std::dec;
+}
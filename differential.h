@@ -0,0 +1,71 @@
+#ifndef DIFFERENTIAL_H
+#define DIFFERENTIAL_H
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <ostream>
+#include <vector>
+
+#include "interpreter.h"
+
+// Anything with the signature of FetchDecodeExecute. Engines must keep all guest-visible state in the Chip8,
+// because the harness replays from copies of it when bisecting (caches keyed on memory contents are fine).
+using Engine = std::function<void(Chip8 &, const std::bitset<16> &, const Params &)>;
+
+typedef struct differentialOptions
+{
+    Params params{};
+    // Passed to SeedRandom for both engines
+    uint32_t seed = 1;
+    // Keypad state per frame, the last entry is held for the rest of the run
+    std::vector<std::bitset<16>> inputMovie;
+    // Timers tick after every this many instructions
+    uint32_t instructionsPerFrame = 11;
+    // Compare state hashes after every this many instructions
+    uint32_t hashInterval = 64;
+    uint64_t maxInstructions = 1'000'000;
+} DifferentialOptions;
+
+typedef struct divergence
+{
+    // Index of the first instruction after which the engines disagree
+    uint64_t instruction;
+    // Machine state both engines agreed on right before that instruction
+    Chip8 before;
+    Chip8 reference;
+    Chip8 candidate;
+    bool referenceTrapped;
+    bool candidateTrapped;
+} Divergence;
+
+typedef struct differentialResult
+{
+    uint64_t instructionsExecuted = 0;
+    // The run ended early on an unknown instruction or a memory trap that both engines agree on
+    bool halted = false;
+    std::optional<Divergence> divergence;
+} DifferentialResult;
+
+// 64-bit hash over every guest-visible field
+uint64_t HashState(const Chip8 &chip8);
+
+bool SameState(const Chip8 &a, const Chip8 &b);
+
+// Runs both engines in lockstep from the same initial machine, comparing hashes every hashInterval instructions.
+// On a mismatch, bisects between the last matching checkpoint and the mismatch to find the first divergent
+// instruction.
+DifferentialResult RunDifferential(const Engine &reference, const Engine &candidate, const Chip8 &initial,
+                                   const DifferentialOptions &options);
+
+// Fills memory from ROM_ADDRESS_START with random but valid instructions, jump targets stay above the fonts
+void GenerateRandomProgram(Chip8 &chip8, uint32_t seed);
+
+// Runs `programs` random programs with random input movies, starting at firstSeed.
+// Every divergence is printed, returns how many programs diverged.
+uint32_t FuzzEngines(const Engine &reference, const Engine &candidate, uint32_t firstSeed, uint32_t programs,
+                     const DifferentialOptions &options, std::ostream &out);
+
+void PrintDivergence(std::ostream &out, const Divergence &divergence);
+
+#endif //DIFFERENTIAL_H
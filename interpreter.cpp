@@ -1,9 +1,12 @@
 #include "interpreter.h"
+#include "latency.h"
 #include <SFML/Graphics.hpp>
+#include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <random>
+#include <sstream>
 #include <thread>
 
 uint16_t characters[16 * 5] = {
@@ -42,16 +45,117 @@ void LoadFontsIntoMemory(Chip8 &chip8)
     }
 }
 
+MemoryTrap::MemoryTrap(const std::string &what, const uint16_t programCounter, const uint16_t opcode,
+                       const uint32_t address) : std::runtime_error(what), programCounter(programCounter),
+                                                 opcode(opcode), address(address)
+{
+}
+
+// Every guest-controlled memory, stack and keypad access goes through the helpers below.
+// The checked build traps on anything out of range, the release build wraps it instead (one AND per access).
+#ifdef CHIP8_CHECKED_MEMORY
+[[noreturn]] void Trap(const char *reason, const uint16_t pc, const uint16_t opcode, const uint32_t address)
+{
+    std::ostringstream message;
+    message << std::hex << std::uppercase << std::setfill('0') << reason << " at PC " << std::setw(3) << pc
+            << " (opcode " << std::setw(4) << opcode << "): " << address;
+    throw MemoryTrap(message.str(), pc, opcode, address);
+}
+
+inline uint16_t MemoryAddress(const uint32_t address, const uint16_t pc, const uint16_t opcode)
+{
+    if (address >= MEMORY_SIZE)
+    {
+        Trap("Memory access out of range", pc, opcode, address);
+    }
+    return address;
+}
+
+inline uint8_t KeyIndex(const uint8_t key, const uint16_t pc, const uint16_t opcode)
+{
+    if (key >= 16)
+    {
+        Trap("Key out of range", pc, opcode, key);
+    }
+    return key;
+}
+
+inline void PushStack(Chip8 &chip8, const uint16_t pc, const uint16_t opcode)
+{
+    if (chip8.sp >= STACK_SIZE)
+    {
+        Trap("Stack overflow", pc, opcode, chip8.sp);
+    }
+    chip8.stack[chip8.sp] = chip8.programCounter;
+    chip8.sp++;
+}
+
+inline uint16_t PopStack(Chip8 &chip8, const uint16_t pc, const uint16_t opcode)
+{
+    if (chip8.sp == 0)
+    {
+        Trap("Stack underflow", pc, opcode, chip8.sp);
+    }
+    chip8.sp--;
+    return chip8.stack[chip8.sp];
+}
+#else
+inline uint16_t MemoryAddress(const uint32_t address, uint16_t, uint16_t)
+{
+    return address & (MEMORY_SIZE - 1);
+}
+
+inline uint8_t KeyIndex(const uint8_t key, uint16_t, uint16_t)
+{
+    return key & 0xF;
+}
+
+// The stack pointer wraps around like a ring buffer, so a runaway recursion overwrites old return addresses
+// instead of the rest of the machine state
+inline void PushStack(Chip8 &chip8, uint16_t, uint16_t)
+{
+    chip8.stack[chip8.sp & (STACK_SIZE - 1)] = chip8.programCounter;
+    chip8.sp = (chip8.sp + 1) & (STACK_SIZE - 1);
+}
+
+inline uint16_t PopStack(Chip8 &chip8, uint16_t, uint16_t)
+{
+    chip8.sp = (chip8.sp - 1) & (STACK_SIZE - 1);
+    return chip8.stack[chip8.sp];
+}
+#endif
+
+void SeedRandom(Chip8 &chip8, const uint32_t seed)
+{
+    // Xorshift never leaves an all-zero state
+    chip8.randomState = seed != 0 ? seed : 0x9E3779B9;
+}
+
+// Anything past the end of memory is dropped (or rejected by the checked build)
+size_t FitRomSize(const size_t size)
+{
+    constexpr size_t maxRomSize = MEMORY_SIZE - ROM_ADDRESS_START;
+    if (size > maxRomSize)
+    {
+#ifdef CHIP8_CHECKED_MEMORY
+        throw MemoryTrap("ROM does not fit in memory", ROM_ADDRESS_START, 0, size);
+#else
+        return maxRomSize;
+#endif
+    }
+    return size;
+}
+
 size_t LoadRomIntoMemory(Chip8 &chip8, const std::string &rom_file)
 {
     std::ifstream rom(rom_file, std::ios::binary);
     if (!rom.is_open())
     {
-        std::cout << "Failed to read file" << std::endl;
+        std::cerr << "Failed to read file" << std::endl;
         exit(1);
     }
     rom.seekg(0, std::ios::end);
-    const auto size = rom.tellg();
+    const size_t size = FitRomSize(rom.tellg());
     rom.seekg(0, std::ios::beg);
     rom.read(reinterpret_cast<char *>(chip8.memory + ROM_ADDRESS_START), size);
     rom.close();
@@ -62,6 +166,17 @@ size_t LoadRomIntoMemory(Chip8 &chip8, const std::string &rom_file)
     return size;
 }
 
+size_t LoadRomIntoMemory(Chip8 &chip8, const std::span<const uint8_t> rom)
+{
+    const size_t size = FitRomSize(rom.size());
+    std::copy_n(rom.data(), size, chip8.memory + ROM_ADDRESS_START);
+
+    // Set PC to first instruction
+    chip8.programCounter = ROM_ADDRESS_START;
+
+    return size;
+}
+
 void UnknownInstruction(const uint8_t byte1, const uint8_t byte2)
 {
     const uint16_t fullInstruction = ((byte1) << 8) | byte2;
@@ -70,7 +185,7 @@ void UnknownInstruction(const uint8_t byte1, const uint8_t byte2)
     exit(1);
 }
 
-inline void DecrementTimers(Chip8 &chip8)
+void DecrementTimers(Chip8 &chip8)
 {
     if (chip8.delayTimer > 0)
     {
@@ -82,11 +197,51 @@ inline void DecrementTimers(Chip8 &chip8)
     }
 }
 
+// Mirrors the decoder in FetchDecodeExecute below
+bool IsKnownInstruction(const uint16_t opcode)
+{
+    switch (opcode >> 12)
+    {
+        case 0:
+            return (opcode & 0xF) == 0 || (opcode & 0xF) == 0xE;
+        case 8:
+            return (opcode & 0xF) <= 7 || (opcode & 0xF) == 0xE;
+        case 0xE:
+            return ((opcode >> 4) & 0xF) == 0x9 || ((opcode >> 4) & 0xF) == 0xA;
+        case 0xF:
+            switch (opcode & 0xFF)
+            {
+                case 0x07:
+                case 0x0A:
+                case 0x15:
+                case 0x18:
+                case 0x1E:
+                case 0x29:
+                case 0x33:
+                case 0x55:
+                case 0x65:
+                    return true;
+                default:
+                    return false;
+            }
+        default:
+            return true;
+    }
+}
+
+uint16_t PeekOpcode(const Chip8 &chip8)
+{
+    return (chip8.memory[chip8.programCounter & (MEMORY_SIZE - 1)] << 8) |
+           chip8.memory[(chip8.programCounter + 1) & (MEMORY_SIZE - 1)];
+}
+
 void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Params &params)
 {
     // Fetch
-    const uint8_t byte1 = chip8.memory[chip8.programCounter];
-    const uint8_t byte2 = chip8.memory[chip8.programCounter + 1];
+    const uint16_t pc = chip8.programCounter;
+    const uint8_t byte1 = chip8.memory[MemoryAddress(pc, pc, 0)];
+    const uint8_t byte2 = chip8.memory[MemoryAddress(pc + 1, pc, 0)];
+    const uint16_t opcode = (byte1 << 8) | byte2;
     chip8.programCounter += 2;
 
     // Decode
@@ -110,8 +265,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
                     break;
                 // RETURN FROM SUBROUTINE
                 case 0xE:
-                    chip8.sp--;
-                    chip8.programCounter = chip8.stack[chip8.sp];
+                    chip8.programCounter = PopStack(chip8, pc, opcode);
                     break;
                 default:
                     UnknownInstruction(byte1, byte2);
@@ -128,8 +282,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
         case 2:
         {
             const uint16_t jumpTo = (byte1Half2 << 8) | byte2;
-            chip8.stack[chip8.sp] = chip8.programCounter;
-            chip8.sp++;
+            PushStack(chip8, pc, opcode);
             chip8.programCounter = jumpTo;
             break;
         }
@@ -268,11 +421,12 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
         case 0xC:
         {
             const uint8_t nn = byte2;
-            std::mt19937 randomEngine(std::random_device{}());
-            std::uniform_int_distribution<uint8_t> distribution(0, 255);
-            uint8_t randomNumber = distribution(randomEngine);
-            randomNumber &= nn;
-            chip8.registers[byte1Half2] = randomNumber;
+            // Xorshift32, the state lives in the machine so that a seeded run is reproducible
+            chip8.randomState ^= chip8.randomState << 13;
+            chip8.randomState ^= chip8.randomState >> 17;
+            chip8.randomState ^= chip8.randomState << 5;
+            const uint8_t randomNumber = chip8.randomState >> 24;
+            chip8.registers[byte1Half2] = randomNumber & nn;
             break;
         }
         // DRAW
@@ -285,7 +439,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
 
             for (uint8_t i = 0; i < n; i++)
             {
-                const uint8_t nthByteSpriteData = chip8.memory[chip8.index + i];
+                const uint8_t nthByteSpriteData = chip8.memory[MemoryAddress(chip8.index + i, pc, opcode)];
                 for (uint8_t j = 0; j < 8; j++)
                 {
                     const uint8_t currentPixel = (nthByteSpriteData & (0b1 << (7 - j))) >> (7 - j);
@@ -322,7 +476,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
             {
                 case 0x9:
                 {
-                    const uint8_t key = chip8.registers[byte1Half2];
+                    const uint8_t key = KeyIndex(chip8.registers[byte1Half2], pc, opcode);
                     if (keypad.test(key))
                     {
                         chip8.programCounter += 2;
@@ -331,7 +485,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
                 }
                 case 0xA:
                 {
-                    const uint8_t key = chip8.registers[byte1Half2];
+                    const uint8_t key = KeyIndex(chip8.registers[byte1Half2], pc, opcode);
                     if (!keypad.test(key))
                     {
                         chip8.programCounter += 2;
@@ -380,7 +534,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
                     }
 
                     // Resume execution on key release
-                    if (chip8.beginKeyPress && !keypad.test(chip8.registers[byte1Half2]))
+                    if (chip8.beginKeyPress && !keypad.test(KeyIndex(chip8.registers[byte1Half2], pc, opcode)))
                     {
                         chip8.beginKeyPress = false;
                         chip8.programCounter += 2;
@@ -403,9 +557,9 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
                     const uint8_t hundreds = number / 100;
                     const uint8_t tens = (number % 100) / 10;
                     const uint8_t ones = number % 10;
-                    chip8.memory[chip8.index] = hundreds;
-                    chip8.memory[chip8.index + 1] = tens;
-                    chip8.memory[chip8.index + 2] = ones;
+                    chip8.memory[MemoryAddress(chip8.index, pc, opcode)] = hundreds;
+                    chip8.memory[MemoryAddress(chip8.index + 1, pc, opcode)] = tens;
+                    chip8.memory[MemoryAddress(chip8.index + 2, pc, opcode)] = ones;
                     break;
                 }
                 // STORE AND LOAD MEM
@@ -414,7 +568,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
                     uint8_t i;
                     for (i = 0; i <= byte1Half2; i++)
                     {
-                        chip8.memory[chip8.index + i] = chip8.registers[i];
+                        chip8.memory[MemoryAddress(chip8.index + i, pc, opcode)] = chip8.registers[i];
                     }
                     chip8.index += params.storeIncrementIndex ? i : 0;
                     break;
@@ -424,7 +578,7 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
                     uint8_t i;
                     for (i = 0; i <= byte1Half2; i++)
                     {
-                        chip8.registers[i] = chip8.memory[chip8.index + i];
+                        chip8.registers[i] = chip8.memory[MemoryAddress(chip8.index + i, pc, opcode)];
                     }
                     chip8.index += params.loadIncrementIndex ? i : 0;
                     break;
@@ -439,6 +593,16 @@ void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Param
     }
 }
 
+uint64_t DisplayRow(const std::bitset<2048> &display, const uint8_t row)
+{
+    uint64_t bits = 0;
+    for (uint8_t column = 0; column < 64; column++)
+    {
+        bits |= static_cast<uint64_t>(display[row * 64 + column]) << column;
+    }
+    return bits;
+}
+
 void Draw(const std::bitset<2048> &display, sf::RenderWindow &window)
 {
     // Loop through the display pixel 2D array and draw it to the SFML window (and scale it up)
@@ -464,7 +628,7 @@ void Draw(const std::bitset<2048> &display, sf::RenderWindow &window)
     window.display();
 }
 
-void InitializeLoopWithRendering(const uint8_t ups, Chip8 &chip8, const Params &params)
+void InitializeLoopWithRendering(const uint8_t ups, Chip8 &chip8, const Params &params, const RenderOptions &options)
 {
     sf::RenderWindow window(sf::VideoMode({64 * SCALE, 32 * SCALE}), "Chip 8", sf::Style::Titlebar | sf::Style::Close);
 
@@ -611,40 +775,174 @@ void InitializeLoopWithRendering(const uint8_t ups, Chip8 &chip8, const Params &
             keypad.reset(0xF);
         }
     };
+    LatencyTracker latency;
+    // Keypad the CPU runs with, a copy of keypad taken whenever the loop samples input
+    std::bitset<16> sampledKeypad{};
+    // Drain window events, noting keypad edges for the latency report as soon as they are seen
+    const auto pollInput = [&]
+    {
+        const std::bitset<16> before = keypad;
+        window.handleEvents(onClose, onKeyPress, onKeyRelease);
+        if (options.measureLatency && keypad != before)
+        {
+            latency.KeypadChanged(before, keypad, std::chrono::steady_clock::now());
+        }
+    };
+    const auto sampleInput = [&]
+    {
+        pollInput();
+        if (options.measureLatency)
+        {
+            latency.KeypadSampled(chip8, sampledKeypad);
+        }
+        sampledKeypad = keypad;
+    };
+    const auto step = [&]
+    {
+        FetchDecodeExecute(chip8, sampledKeypad, params);
+        if (options.measureLatency)
+        {
+            latency.InstructionExecuted(params);
+        }
+    };
+    const auto tickTimers = [&]
+    {
+        DecrementTimers(chip8);
+        if (options.measureLatency)
+        {
+            latency.TimersDecremented();
+        }
+    };
+    const auto present = [&]
+    {
+        Draw(chip8.display, window);
+        if (options.measureLatency)
+        {
+            latency.FramePresented(chip8.display, std::chrono::steady_clock::now());
+        }
+    };
+
     constexpr double sixtyHz = 60.0;
     constexpr auto intervalForHz = std::chrono::duration<double>(1 / sixtyHz);
-    const auto intervalBetweenUpdates = std::chrono::duration<double>(1.0 / ups);
-    auto lastFrameTime = std::chrono::steady_clock::now();
-    std::chrono::duration<double> cpuTime{0.0};
-    std::chrono::duration<double> drawTime{0.0};
-    std::chrono::duration<double> timerTime{0.0};
 
-    while (window.isOpen())
+    if (options.lateInputSampling)
     {
-        window.handleEvents(onClose, onKeyPress, onKeyRelease);
+        // One CPU batch per frame: sleep until just enough time is left to poll, run the batch and draw,
+        // so the sampled keypad is as fresh as possible when the frame is presented
+        const auto frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(intervalForHz);
+        constexpr auto safetyMargin = std::chrono::microseconds(500);
+        constexpr auto eventSlice = std::chrono::milliseconds(1);
+        const double instructionsPerFrame = ups / sixtyHz;
+        double instructionBudget = 0.0;
+        std::chrono::steady_clock::duration workEstimate = std::chrono::milliseconds(1);
+        auto nextFrameTime = std::chrono::steady_clock::now() + frameInterval;
 
-        const auto latestFrameTime = std::chrono::steady_clock::now();
-        const auto deltaTime = latestFrameTime - lastFrameTime;
-        lastFrameTime = latestFrameTime;
+        while (window.isOpen())
+        {
+            // Keep draining events while waiting, so that edges are timestamped when they arrive and not when the
+            // sample point comes around. The CPU still only sees them at the sample point.
+            const auto samplePoint = nextFrameTime - workEstimate - safetyMargin;
+            while (std::chrono::steady_clock::now() + eventSlice < samplePoint)
+            {
+                std::this_thread::sleep_for(eventSlice);
+                pollInput();
+            }
+            std::this_thread::sleep_until(samplePoint);
+            const auto workStart = std::chrono::steady_clock::now();
 
-        cpuTime += deltaTime;
-        drawTime += deltaTime;
-        timerTime += deltaTime;
+            sampleInput();
+            instructionBudget += instructionsPerFrame;
+            while (instructionBudget >= 1.0)
+            {
+                step();
+                instructionBudget -= 1.0;
+            }
+            tickTimers();
+            present();
+
+            // Follow slower frames immediately, forget them slowly
+            const auto workEnd = std::chrono::steady_clock::now();
+            const auto work = workEnd - workStart;
+            workEstimate = work > workEstimate ? work : (workEstimate * 15 + work) / 16;
+
+            nextFrameTime += frameInterval;
+            if (nextFrameTime < workEnd)
+            {
+                // Fell behind (e.g. window dragged), resynchronise instead of running a burst of frames
+                nextFrameTime = workEnd + frameInterval;
+            }
+        }
+    }
+    else
+    {
+        const auto intervalBetweenUpdates = std::chrono::duration<double>(1.0 / ups);
+        auto lastFrameTime = std::chrono::steady_clock::now();
+        std::chrono::duration<double> cpuTime{0.0};
+        std::chrono::duration<double> drawTime{0.0};
+        std::chrono::duration<double> timerTime{0.0};
 
-        while (timerTime >= intervalForHz)
+        while (window.isOpen())
         {
-            DecrementTimers(chip8);
-            timerTime -= intervalForHz;
+            sampleInput();
+
+            const auto latestFrameTime = std::chrono::steady_clock::now();
+            const auto deltaTime = latestFrameTime - lastFrameTime;
+            lastFrameTime = latestFrameTime;
+
+            cpuTime += deltaTime;
+            drawTime += deltaTime;
+            timerTime += deltaTime;
+
+            while (timerTime >= intervalForHz)
+            {
+                tickTimers();
+                timerTime -= intervalForHz;
+            }
+            while (cpuTime >= intervalBetweenUpdates)
+            {
+                step();
+                cpuTime -= intervalBetweenUpdates;
+            }
+            while (drawTime >= intervalForHz)
+            {
+                present();
+                drawTime -= intervalForHz;
+            }
         }
-        while (cpuTime >= intervalBetweenUpdates)
+    }
+
+    if (options.measureLatency)
+    {
+        latency.Report(std::cout);
+    }
+}
+
+void RunHeadless(const uint8_t ups, Chip8 &chip8, const Params &params, const uint64_t frames,
+                 const std::function<bool(Chip8 &, std::bitset<16> &)> &onFrame)
+{
+    std::bitset<16> keypad{};
+    // Carry the fractional part so that e.g. 100 ups runs 1 or 2 instructions per frame and averages out
+    const double instructionsPerFrame = ups / 60.0;
+    double instructionBudget = 0.0;
+
+    for (uint64_t frame = 0; frame < frames; frame++)
+    {
+        bool halted = false;
+        instructionBudget += instructionsPerFrame;
+        while (instructionBudget >= 1.0)
         {
+            if (!IsKnownInstruction(PeekOpcode(chip8)))
+            {
+                halted = true;
+                break;
+            }
             FetchDecodeExecute(chip8, keypad, params);
-            cpuTime -= intervalBetweenUpdates;
+            instructionBudget -= 1.0;
         }
-        while (drawTime >= intervalForHz)
+        DecrementTimers(chip8);
+        if (!onFrame(chip8, keypad) || halted)
         {
-            Draw(chip8.display, window);
-            drawTime -= intervalForHz;
+            break;
         }
     }
 }
@@ -2,19 +2,27 @@
 #define INTERPRETER_H
 #include <bitset>
 #include <cstdint>
+#include <functional>
+#include <span>
+#include <stdexcept>
+#include <string>
 
 constexpr uint8_t SCALE = 10;
 constexpr uint8_t FONT_ADDRESS_START = 0x50;
 constexpr uint16_t ROM_ADDRESS_START = 0x200;
+constexpr uint16_t MEMORY_SIZE = 4096;
+constexpr uint8_t STACK_SIZE = 16;
 
 typedef struct hardware
 {
     // Order from smallest to biggest for alignment
-    uint8_t memory[4096]{};
+    uint8_t memory[MEMORY_SIZE]{};
     // 64 x 32 pixels black or white
     std::bitset<2048> display;
+    // Xorshift state behind CXNN, set with SeedRandom so that runs can be replayed
+    uint32_t randomState = 0x9E3779B9;
     // Stack for 16-bit addresses
-    uint16_t stack[16]{};
+    uint16_t stack[STACK_SIZE]{};
     // Registers V0 - VF
     uint8_t registers[16]{};
     // Point to current instruction in memory
@@ -41,10 +49,58 @@ typedef struct params
     bool resetFlagOnBitOperations = false;
 } Params;
 
+// Raised by the checked build (CHIP8_CHECKED_MEMORY) when an instruction touches memory, the stack or the keypad
+// out of range. The release build never raises it: addresses are masked to 12 bits and the stack pointer to 4 bits.
+struct MemoryTrap : std::runtime_error
+{
+    // Address of the faulting instruction (not the incremented PC)
+    uint16_t programCounter;
+    uint16_t opcode;
+    // Offending memory address, stack pointer or key, depending on the access
+    uint32_t address;
+
+    MemoryTrap(const std::string &what, uint16_t programCounter, uint16_t opcode, uint32_t address);
+};
+
+// Frontend options for the windowed loop
+typedef struct renderOptions
+{
+    // Poll input right before each frame's CPU batch and present right after it,
+    // instead of running input, CPU and drawing on independent accumulators
+    bool lateInputSampling = false;
+    // Report keypad-to-present latency percentiles when the window closes
+    bool measureLatency = false;
+} RenderOptions;
+
 void LoadFontsIntoMemory(Chip8 &chip8);
 
+void SeedRandom(Chip8 &chip8, uint32_t seed);
+
 size_t LoadRomIntoMemory(Chip8 &chip8, const std::string &rom_file);
 
-void InitializeLoopWithRendering(uint8_t ups, Chip8 &chip8, const Params &params);
+// Copies a ROM that is already in memory (e.g. a RomLibrary mapping) without touching the file system
+size_t LoadRomIntoMemory(Chip8 &chip8, std::span<const uint8_t> rom);
+
+void DecrementTimers(Chip8 &chip8);
+
+// False for opcodes that FetchDecodeExecute rejects (and exits on), so hosts can stop a ROM before it gets there
+bool IsKnownInstruction(uint16_t opcode);
+
+// Opcode at the program counter without executing it, wrapping around memory like the masked build does
+uint16_t PeekOpcode(const Chip8 &chip8);
+
+void FetchDecodeExecute(Chip8 &chip8, const std::bitset<16> &keypad, const Params &params);
+
+void InitializeLoopWithRendering(uint8_t ups, Chip8 &chip8, const Params &params, const RenderOptions &options = {});
+
+// Runs the given number of 60Hz frames without a window and without waiting between them.
+// onFrame sees the machine after each frame and may change the keypad used by the next one, returning false stops
+// the run early. The run also stops in front of an unknown instruction instead of exiting, after reporting the frame
+// it was reached in, so callers can flush their output and check IsKnownInstruction(PeekOpcode(chip8)) afterwards.
+void RunHeadless(uint8_t ups, Chip8 &chip8, const Params &params, uint64_t frames,
+                 const std::function<bool(Chip8 &, std::bitset<16> &)> &onFrame);
+
+// Packs one 64-pixel row of the display into a word, bit 0 is column 0
+uint64_t DisplayRow(const std::bitset<2048> &display, uint8_t row);
 
 #endif //INTERPRETER_H
@@ -0,0 +1,107 @@
+#include "latency.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+void LatencyTracker::KeypadChanged(const std::bitset<16> &before, const std::bitset<16> &after,
+                                   const Clock::time_point when)
+{
+    // One sample per changed key, so chords are weighted like separate presses
+    const size_t edges = (before ^ after).count();
+    unsampled.insert(unsampled.end(), edges, when);
+}
+
+void LatencyTracker::KeypadSampled(const Chip8 &chip8, const std::bitset<16> &previous)
+{
+    if (unsampled.empty())
+    {
+        return;
+    }
+    // A tap that was pressed and released between two samples still forks, the fork and the machine then stay
+    // identical and the tap ends up unanswered, which is what it was
+    forks.push_back({chip8, previous, std::move(unsampled), 0, false});
+    unsampled.clear();
+}
+
+void LatencyTracker::InstructionExecuted(const Params &params)
+{
+    for (Fork &fork: forks)
+    {
+        if (fork.halted || !IsKnownInstruction(PeekOpcode(fork.machine)))
+        {
+            fork.halted = true;
+            continue;
+        }
+        try
+        {
+            FetchDecodeExecute(fork.machine, fork.keypad, params);
+        }
+        catch (const MemoryTrap &)
+        {
+            fork.halted = true;
+        }
+    }
+}
+
+void LatencyTracker::TimersDecremented()
+{
+    for (Fork &fork: forks)
+    {
+        if (!fork.halted)
+        {
+            DecrementTimers(fork.machine);
+        }
+    }
+}
+
+void LatencyTracker::FramePresented(const std::bitset<2048> &display, const Clock::time_point when)
+{
+    std::erase_if(forks, [&](Fork &fork)
+    {
+        if (display != fork.machine.display)
+        {
+            for (const Clock::time_point changedAt: fork.edges)
+            {
+                samples.push_back(std::chrono::duration<double, std::milli>(when - changedAt).count());
+            }
+            return true;
+        }
+        if (++fork.framesWaited > MAX_FRAMES_WAITED)
+        {
+            unanswered += fork.edges.size();
+            return true;
+        }
+        return false;
+    });
+}
+
+double LatencyTracker::Percentile(const double percentile) const
+{
+    if (samples.empty())
+    {
+        return 0.0;
+    }
+    // Nearest-rank percentile
+    std::vector<double> sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+    const size_t rank = std::ceil(percentile / 100.0 * sorted.size());
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+size_t LatencyTracker::Answered() const
+{
+    return samples.size();
+}
+
+size_t LatencyTracker::Unanswered() const
+{
+    return unanswered;
+}
+
+void LatencyTracker::Report(std::ostream &out) const
+{
+    out << std::fixed << std::setprecision(2) << "Input latency over " << Answered() << " edges ("
+            << Unanswered() << " without a visible reaction): p50 " << Percentile(50) << " ms, p90 "
+            << Percentile(90) << " ms, p99 " << Percentile(99) << " ms, max " << Percentile(100) << " ms"
+            << std::endl;
+}
@@ -0,0 +1,65 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "interpreter.h"
+
+// Measures input-to-photon latency: the time from a keypad edge (press or release) being seen by the frontend
+// to the first presented frame that reflects it.
+// When the machine picks up changed keys, the tracker forks it and keeps running the fork with the old keypad. The
+// first presented frame whose display differs from the fork's is the one that reflects the edges, so a game that
+// animates and polls the keypad every frame is not credited with a reaction it did not have. Edges without a visible
+// reaction within MAX_FRAMES_WAITED frames are counted as unanswered instead of skewing the percentiles.
+class LatencyTracker
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint32_t MAX_FRAMES_WAITED = 60;
+
+    // The frontend saw keys change, the machine picks the change up at the next KeypadSampled
+    void KeypadChanged(const std::bitset<16> &before, const std::bitset<16> &after, Clock::time_point when);
+
+    // Call right before chip8 starts running with a newly sampled keypad, previous being the one it ran with so far
+    void KeypadSampled(const Chip8 &chip8, const std::bitset<16> &previous);
+
+    // Call after every instruction the machine executes and every timer tick, so the forks keep pace with it
+    void InstructionExecuted(const Params &params);
+
+    void TimersDecremented();
+
+    void FramePresented(const std::bitset<2048> &display, Clock::time_point when);
+
+    // Milliseconds at the given percentile (0 - 100) of answered edges, 0 if there are none
+    double Percentile(double percentile) const;
+
+    size_t Answered() const;
+
+    size_t Unanswered() const;
+
+    void Report(std::ostream &out) const;
+
+private:
+    // The machine as it would have run without the edges, one per sample point that picked up changed keys
+    typedef struct fork
+    {
+        Chip8 machine;
+        std::bitset<16> keypad;
+        std::vector<Clock::time_point> edges;
+        uint32_t framesWaited;
+        // The fork reached an instruction the real machine never ran into, it stays frozen from then on
+        bool halted;
+    } Fork;
+
+    // Edges seen since the last sample point
+    std::vector<Clock::time_point> unsampled;
+    std::vector<Fork> forks;
+    std::vector<double> samples;
+    size_t unanswered = 0;
+};
+
+#endif //LATENCY_H
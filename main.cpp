@@ -1,10 +1,46 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <optional>
+#include <random>
+#include <thread>
 
+#include "capture.h"
 #include "interpreter.h"
+#include "romlibrary.h"
+#include "scheduler.h"
+#include "sharedframe.h"
 
 // test roms: https://github.com/Timendus/chip8-test-suite
 
+// Set by SIGINT or SIGTERM to shut the session server or a headless run down cleanly, so that the shared-memory
+// segment and the socket are removed and the capture is flushed
+std::atomic<bool> stopRequested = false;
+
+void RequestStop(int)
+{
+    stopRequested = true;
+}
+
+// Returns the argument following flag, or nullptr if the flag (or its value) is missing
+const char *FlagValue(const int argc, char *argv[], const char *flag, const int offset = 1)
+{
+    for (int i = 1; i + offset < argc; ++i)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return argv[i + offset];
+        }
+    }
+    return nullptr;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 3)
@@ -12,6 +48,8 @@ int main(int argc, char *argv[])
         // SHIFT: Set VX to the value of VY when shifting.
         std::cout << "Usage: " << argv[0] <<
                 " <rom file> <updates per second> [-shift] -[jumpWithOffset] [-loadIncrementIndex] [-storeIncrementIndex]"
+                " [-capture <pbm|png|y4m> <output> <frames>] [-captureScale <n>] [-rgb] [-lateInput] [-measureLatency]"
+                " [-autoQuirks] [-quirkDatabase <file>] [-serve <unix socket path>] [-shm <name>] [-realtime]"
                 << std::endl;
         exit(1);
     }
@@ -23,7 +61,45 @@ int main(int argc, char *argv[])
         argvString += " ";
     }
 
+    const std::string rom_file = argv[1];
+
     Params params{};
+    // AUTO QUIRKS: Look the ROM's SHA-1 up in the shipped quirk database and an optional user one (whose entries win),
+    // flags below are added on top
+    std::optional<MappedRom> mappedRom;
+    if (argvString.find("-autoQuirks ") != std::string::npos)
+    {
+        const std::filesystem::path shipped = std::filesystem::path(argv[0]).parent_path() / DEFAULT_QUIRK_DATABASE;
+        if (LoadQuirkDatabase(shipped.string()) < 0)
+        {
+            std::cerr << "Failed to read " << shipped.string() << ", only -quirkDatabase profiles are known"
+                    << std::endl;
+        }
+        if (const char *database = FlagValue(argc, argv, "-quirkDatabase"))
+        {
+            if (LoadQuirkDatabase(database) < 0)
+            {
+                std::cerr << "Failed to read quirk database" << std::endl;
+                exit(1);
+            }
+        }
+
+        mappedRom.emplace(rom_file);
+        if (!mappedRom->IsOpen())
+        {
+            std::cerr << "Failed to read file" << std::endl;
+            exit(1);
+        }
+        if (const Params *known = LookupQuirks(mappedRom->Hash()))
+        {
+            params = *known;
+        }
+        else
+        {
+            std::cerr << "Unknown ROM " << mappedRom->Hash() << ", using default quirks" << std::endl;
+        }
+    }
+
     if (argc >= 4)
     {
         if (argvString.find("-shift") != std::string::npos)
@@ -52,11 +128,137 @@ int main(int argc, char *argv[])
         }
     }
 
-    const std::string rom_file = argv[1];
     const uint8_t ups = atoi(argv[2]);
 
     Chip8 chip8;
-    LoadFontsIntoMemory(chip8);
-    LoadRomIntoMemory(chip8, rom_file);
-    InitializeLoopWithRendering(ups, chip8, params);
+    SeedRandom(chip8, std::random_device{}());
+    try
+    {
+        // SERVE: Run one session per client connecting to a Unix socket
+        if (const char *socketPath = FlagValue(argc, argv, "-serve"))
+        {
+            const MappedRom rom(rom_file);
+            if (!rom.IsOpen())
+            {
+                std::cerr << "Failed to read file" << std::endl;
+                exit(1);
+            }
+            std::signal(SIGINT, RequestStop);
+            std::signal(SIGTERM, RequestStop);
+            SessionScheduler scheduler;
+            ServeUnixSocket(scheduler, socketPath, rom.Bytes(), params, ups, stopRequested);
+            return 0;
+        }
+
+        LoadFontsIntoMemory(chip8);
+        if (mappedRom)
+        {
+            LoadRomIntoMemory(chip8, mappedRom->Bytes());
+        }
+        else
+        {
+            LoadRomIntoMemory(chip8, rom_file);
+        }
+        // HEADLESS: Record frames (CAPTURE) and/or export them through shared memory (SHM) instead of opening a window
+        const char *format = FlagValue(argc, argv, "-capture", 1);
+        const char *shmName = FlagValue(argc, argv, "-shm");
+        if (format || shmName)
+        {
+            std::optional<FrameCapture> capture;
+            uint64_t frameCount = UINT64_MAX;
+            if (format)
+            {
+                const char *output = FlagValue(argc, argv, "-capture", 2);
+                const char *frames = FlagValue(argc, argv, "-capture", 3);
+                if (!output || !frames)
+                {
+                    std::cerr << "-capture needs a format, an output and a frame count" << std::endl;
+                    exit(1);
+                }
+
+                CaptureOptions options{};
+                if (strcmp(format, "pbm") == 0)
+                {
+                    options.format = CaptureFormat::Pbm;
+                }
+                else if (strcmp(format, "png") == 0)
+                {
+                    options.format = CaptureFormat::Png;
+                }
+                else if (strcmp(format, "y4m") != 0)
+                {
+                    std::cerr << "Unknown capture format: " << format << std::endl;
+                    exit(1);
+                }
+                options.output = output;
+                if (const char *scale = FlagValue(argc, argv, "-captureScale"))
+                {
+                    // Scale is stored in a byte
+                    options.scale = std::clamp(atoi(scale), 1, 255);
+                }
+                options.rgb = argvString.find("-rgb ") != std::string::npos;
+                capture.emplace(options);
+                frameCount = std::strtoull(frames, nullptr, 10);
+            }
+
+            // SHM: External processes read frames and inject the keypad through a shared-memory segment
+            std::optional<SharedFrameExport> shared;
+            if (shmName)
+            {
+                shared.emplace(shmName[0] == '/' ? shmName : std::string("/") + shmName);
+            }
+
+            // REALTIME: Pace frames at 60Hz, e.g. for bots playing through shared memory
+            const bool realtime = argvString.find("-realtime ") != std::string::npos;
+            const auto frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(1 / 60.0));
+            auto nextFrameTime = std::chrono::steady_clock::now();
+            uint64_t frame = 0;
+
+            std::signal(SIGINT, RequestStop);
+            std::signal(SIGTERM, RequestStop);
+            RunHeadless(ups, chip8, params, frameCount, [&](Chip8 &machine, std::bitset<16> &keypad)
+            {
+                if (capture)
+                {
+                    capture->Submit(machine.display);
+                }
+                if (shared)
+                {
+                    shared->Publish(machine, keypad, frame);
+                    keypad = shared->InjectedKeypad();
+                }
+                if (realtime)
+                {
+                    nextFrameTime += frameInterval;
+                    std::this_thread::sleep_until(nextFrameTime);
+                }
+                frame++;
+                return !stopRequested;
+            });
+
+            // The run stops in front of an unknown instruction, report it once the capture is flushed
+            const uint16_t opcode = PeekOpcode(chip8);
+            if (!IsKnownInstruction(opcode))
+            {
+                capture.reset();
+                shared.reset();
+                std::cerr << "Unknown Instruction: " << std::hex << std::uppercase << std::setw(4)
+                        << std::setfill('0') << opcode << std::endl;
+                exit(1);
+            }
+        }
+        else
+        {
+            RenderOptions options{};
+            options.lateInputSampling = argvString.find("-lateInput ") != std::string::npos;
+            options.measureLatency = argvString.find("-measureLatency ") != std::string::npos;
+            InitializeLoopWithRendering(ups, chip8, params, options);
+        }
+    }
+    catch (const MemoryTrap &trap)
+    {
+        std::cerr << trap.what() << std::endl;
+        exit(1);
+    }
 }
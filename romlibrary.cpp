@@ -0,0 +1,299 @@
+#include "romlibrary.h"
+#include <algorithm>
+#include <array>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace
+{
+    uint32_t RotateLeft(const uint32_t value, const uint8_t bits)
+    {
+        return (value << bits) | (value >> (32 - bits));
+    }
+
+    // Profiles keyed by SHA-1, filled by LoadQuirkDatabase from the shipped quirks.txt and any user database
+    std::unordered_map<std::string, Params> &QuirkDatabase()
+    {
+        static std::unordered_map<std::string, Params> database;
+        return database;
+    }
+
+    // One 64-byte SHA-1 block
+    void Sha1Block(uint32_t (&h)[5], const uint8_t *block)
+    {
+        uint32_t w[80];
+        for (uint8_t i = 0; i < 16; i++)
+        {
+            const uint8_t *word = block + i * 4;
+            w[i] = (word[0] << 24) | (word[1] << 16) | (word[2] << 8) | word[3];
+        }
+        for (uint8_t i = 16; i < 80; i++)
+        {
+            w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (uint8_t i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            const uint32_t temp = RotateLeft(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = RotateLeft(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+}
+
+std::string Sha1(const std::span<const uint8_t> bytes)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    // Whole blocks are hashed straight from the input, so mapped ROMs are never copied
+    const size_t wholeBlocks = bytes.size() / 64 * 64;
+    for (size_t block = 0; block < wholeBlocks; block += 64)
+    {
+        Sha1Block(h, bytes.data() + block);
+    }
+
+    // Tail, a 1 bit, zero padding up to 56 mod 64 bytes, then the length in bits as a big-endian uint64
+    uint8_t tail[128]{};
+    const size_t remaining = bytes.size() - wholeBlocks;
+    std::copy_n(bytes.data() + wholeBlocks, remaining, tail);
+    tail[remaining] = 0x80;
+    const size_t tailSize = remaining < 56 ? 64 : 128;
+    const uint64_t bitLength = static_cast<uint64_t>(bytes.size()) * 8;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        tail[tailSize - 1 - i] = bitLength >> (i * 8);
+    }
+    for (size_t block = 0; block < tailSize; block += 64)
+    {
+        Sha1Block(h, tail + block);
+    }
+
+    std::ostringstream hex;
+    hex << std::hex << std::setfill('0');
+    for (const uint32_t word: h)
+    {
+        hex << std::setw(8) << word;
+    }
+    return hex.str();
+}
+
+MappedRom::MappedRom(const std::string &path) : path(path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat status{};
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode))
+    {
+        size = status.st_size;
+        // mmap refuses empty files, an empty ROM is still a valid (if useless) ROM
+        if (size == 0)
+        {
+            open = true;
+        }
+        else
+        {
+            void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                data = static_cast<const uint8_t *>(mapping);
+                open = true;
+            }
+        }
+    }
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+
+    if (open)
+    {
+        hash = Sha1(Bytes());
+    }
+}
+
+MappedRom::~MappedRom()
+{
+    if (data)
+    {
+        munmap(const_cast<uint8_t *>(data), size);
+    }
+}
+
+MappedRom::MappedRom(MappedRom &&other) noexcept : path(std::move(other.path)), data(other.data), size(other.size),
+                                                   open(other.open), hash(std::move(other.hash))
+{
+    other.data = nullptr;
+    other.size = 0;
+    other.open = false;
+}
+
+MappedRom &MappedRom::operator=(MappedRom &&other) noexcept
+{
+    std::swap(path, other.path);
+    std::swap(data, other.data);
+    std::swap(size, other.size);
+    std::swap(open, other.open);
+    std::swap(hash, other.hash);
+    return *this;
+}
+
+bool MappedRom::IsOpen() const
+{
+    return open;
+}
+
+const std::string &MappedRom::Path() const
+{
+    return path;
+}
+
+std::span<const uint8_t> MappedRom::Bytes() const
+{
+    return {data, size};
+}
+
+const std::string &MappedRom::Hash() const
+{
+    return hash;
+}
+
+RomLibrary::RomLibrary(const std::string &directory)
+{
+    std::error_code error;
+    for (const auto &entry: std::filesystem::directory_iterator(directory, error))
+    {
+        if (!entry.is_regular_file())
+        {
+            continue;
+        }
+        MappedRom rom(entry.path().string());
+        if (!rom.IsOpen())
+        {
+            // One unreadable file should not stop a batch run over thousands of ROMs
+            std::cerr << "Failed to map " << entry.path().string() << std::endl;
+            continue;
+        }
+        roms.push_back(std::move(rom));
+    }
+    if (error)
+    {
+        std::cerr << "Failed to read directory " << directory << ": " << error.message() << std::endl;
+    }
+
+    // Sorted by hash for Find
+    std::sort(roms.begin(), roms.end(), [](const MappedRom &a, const MappedRom &b) { return a.Hash() < b.Hash(); });
+}
+
+const std::vector<MappedRom> &RomLibrary::Roms() const
+{
+    return roms;
+}
+
+const MappedRom *RomLibrary::Find(const std::string &hash) const
+{
+    const auto rom = std::lower_bound(roms.begin(), roms.end(), hash,
+                                      [](const MappedRom &a, const std::string &b) { return a.Hash() < b; });
+    return rom != roms.end() && rom->Hash() == hash ? &*rom : nullptr;
+}
+
+const Params *LookupQuirks(const std::string &hash)
+{
+    const auto &database = QuirkDatabase();
+    const auto profile = database.find(hash);
+    return profile != database.end() ? &profile->second : nullptr;
+}
+
+int LoadQuirkDatabase(const std::string &file)
+{
+    std::ifstream database(file);
+    if (!database.is_open())
+    {
+        return -1;
+    }
+
+    int added = 0;
+    std::string line;
+    while (std::getline(database, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string hash;
+        if (!(fields >> hash))
+        {
+            continue;
+        }
+        std::transform(hash.begin(), hash.end(), hash.begin(), ::tolower);
+
+        Params params{};
+        std::string flag;
+        while (fields >> flag)
+        {
+            if (flag == "-shift")
+            {
+                params.shift = true;
+            }
+            else if (flag == "-jumpWithOffset")
+            {
+                params.jumpWithOffset = true;
+            }
+            else if (flag == "-storeIncrementIndex")
+            {
+                params.storeIncrementIndex = true;
+            }
+            else if (flag == "-loadIncrementIndex")
+            {
+                params.loadIncrementIndex = true;
+            }
+            else if (flag == "-resetFlagOnBitOperations")
+            {
+                params.resetFlagOnBitOperations = true;
+            }
+            else
+            {
+                std::cerr << "Unknown quirk " << flag << " for " << hash << std::endl;
+            }
+        }
+        QuirkDatabase()[hash] = params;
+        added++;
+    }
+    return added;
+}
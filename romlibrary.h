@@ -0,0 +1,72 @@
+#ifndef ROMLIBRARY_H
+#define ROMLIBRARY_H
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "interpreter.h"
+
+// Read-only memory mapping of a single ROM file, unmapped on destruction
+class MappedRom
+{
+public:
+    explicit MappedRom(const std::string &path);
+
+    ~MappedRom();
+
+    MappedRom(MappedRom &&other) noexcept;
+
+    MappedRom &operator=(MappedRom &&other) noexcept;
+
+    MappedRom(const MappedRom &) = delete;
+    MappedRom &operator=(const MappedRom &) = delete;
+
+    bool IsOpen() const;
+
+    const std::string &Path() const;
+
+    // Points straight into the mapping, valid as long as this object lives
+    std::span<const uint8_t> Bytes() const;
+
+    // Lowercase hex SHA-1 of the contents, the same key the community CHIP-8 database uses
+    const std::string &Hash() const;
+
+private:
+    std::string path;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool open = false;
+    std::string hash;
+};
+
+// Maps every regular file in a directory once and indexes it by content hash.
+// Instances load ROMs straight from the mappings with the span overload of LoadRomIntoMemory.
+class RomLibrary
+{
+public:
+    explicit RomLibrary(const std::string &directory);
+
+    const std::vector<MappedRom> &Roms() const;
+
+    // nullptr when no ROM in the library has this hash
+    const MappedRom *Find(const std::string &hash) const;
+
+private:
+    std::vector<MappedRom> roms;
+};
+
+std::string Sha1(std::span<const uint8_t> bytes);
+
+// Quirk profile for a ROM hash loaded by LoadQuirkDatabase, nullptr when the ROM is unknown
+const Params *LookupQuirks(const std::string &hash);
+
+// Database shipped with the emulator (quirks.txt), -autoQuirks loads it from the executable's directory
+constexpr const char *DEFAULT_QUIRK_DATABASE = "quirks.txt";
+
+// Adds profiles from a text file, one ROM per line:
+// <sha1> [-shift] [-jumpWithOffset] [-storeIncrementIndex] [-loadIncrementIndex] [-resetFlagOnBitOperations] [# title]
+// Returns the number of profiles added, or -1 if the file cannot be read
+int LoadQuirkDatabase(const std::string &file);
+
+#endif //ROMLIBRARY_H
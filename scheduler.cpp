@@ -0,0 +1,550 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <random>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct SessionScheduler::SessionTask::promise_type
+{
+    Session &session;
+    SessionScheduler &scheduler;
+
+    // Coroutine parameters are forwarded to the promise, which is how it learns its session
+    promise_type(SessionScheduler &scheduler, Session &session) : session(session), scheduler(scheduler)
+    {
+    }
+
+    SessionTask get_return_object()
+    {
+        return SessionTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    // Sessions are created parked and start on the next Tick
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    // Stay suspended at the end so that the scheduler destroys the frame, not the worker that finished it
+    auto final_suspend() noexcept
+    {
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(const std::coroutine_handle<promise_type> handle) const noexcept
+            {
+                handle.promise().scheduler.Finished(handle.promise().session);
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        };
+        return FinalAwaiter{};
+    }
+
+    void return_void()
+    {
+    }
+
+    void unhandled_exception()
+    {
+        std::terminate();
+    }
+};
+
+SessionScheduler::SessionTask::SessionTask(const std::coroutine_handle<promise_type> handle) : handle(handle)
+{
+}
+
+bool SessionScheduler::FrameAwaiter::await_ready() const noexcept
+{
+    return false;
+}
+
+void SessionScheduler::FrameAwaiter::await_suspend(const std::coroutine_handle<> handle)
+{
+    // Another worker may resume the session as soon as it is parked, so nothing may touch it afterwards
+    scheduler.Park(handle);
+}
+
+void SessionScheduler::FrameAwaiter::await_resume() const noexcept
+{
+}
+
+FdFrameSink::FdFrameSink(const int fd) : fd(fd)
+{
+    // Shared with every dup of the descriptor, which only ever polls before reading
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+FdFrameSink::~FdFrameSink()
+{
+    close(fd);
+}
+
+bool FdFrameSink::Flush()
+{
+    size_t written = 0;
+    while (written < backlog.size())
+    {
+        // MSG_NOSIGNAL: a client that hung up must not take the whole server down with SIGPIPE
+        ssize_t result = send(fd, backlog.data() + written, backlog.size() - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result < 0 && errno == ENOTSOCK)
+        {
+            result = write(fd, backlog.data() + written, backlog.size() - written);
+        }
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (result <= 0)
+        {
+            // The session ends on its own once the client's input reaches EOF
+            backlog.clear();
+            return false;
+        }
+        written += result;
+    }
+    backlog.erase(backlog.begin(), backlog.begin() + written);
+    return true;
+}
+
+void FdFrameSink::OnFrame(const uint32_t session, const uint64_t frame, const std::bitset<2048> &display,
+                          const std::bitset<2048> &changed)
+{
+    // Header plus every row
+    constexpr size_t largestMessage = 16 + 32 * 8;
+
+    std::lock_guard lock(writeMutex);
+    if (!closed)
+    {
+        closed = !Flush();
+    }
+    if (closed)
+    {
+        return;
+    }
+    if (backlog.size() + largestMessage > MAX_BACKLOG)
+    {
+        // The client is not keeping up: skip this frame rather than queue without bound
+        resync = true;
+        return;
+    }
+
+    uint32_t changedRows = 0;
+    for (uint8_t row = 0; row < 32; row++)
+    {
+        for (uint8_t column = 0; column < 64; column++)
+        {
+            if (changed[row * 64 + column])
+            {
+                changedRows |= 1u << row;
+                break;
+            }
+        }
+    }
+    if (resync)
+    {
+        changedRows = 0xFFFFFFFF;
+        resync = false;
+    }
+
+    const auto append = [this](const uint64_t value, const uint8_t bytes)
+    {
+        for (uint8_t i = 0; i < bytes; i++)
+        {
+            backlog.push_back(value >> (i * 8));
+        }
+    };
+    append(session, 4);
+    append(frame, 8);
+    append(changedRows, 4);
+    for (uint8_t row = 0; row < 32; row++)
+    {
+        if (changedRows & (1u << row))
+        {
+            append(DisplayRow(display, row), 8);
+        }
+    }
+    closed = !Flush();
+}
+
+SessionScheduler::SessionScheduler(const size_t threads)
+{
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); i++)
+    {
+        workers.emplace_back(&SessionScheduler::WorkerLoop, this);
+    }
+}
+
+SessionScheduler::~SessionScheduler()
+{
+    {
+        std::lock_guard lock(queueMutex);
+        stopping = true;
+    }
+    queueNotEmpty.notify_all();
+    for (std::thread &worker: workers)
+    {
+        worker.join();
+    }
+
+    // Every coroutine is suspended now: parked, queued but never resumed, or finished
+    for (const auto &session: sessions)
+    {
+        session->handle.destroy();
+        if (session->inputFd >= 0)
+        {
+            close(session->inputFd);
+        }
+    }
+}
+
+uint32_t SessionScheduler::AddSession(const Chip8 &initial, const Params &params, const uint16_t ups,
+                                      std::shared_ptr<FrameSink> sink)
+{
+    auto session = std::make_unique<Session>();
+    session->chip8 = initial;
+    session->params = params;
+    session->instructionsPerFrame = ups / 60.0;
+    session->sink = std::move(sink);
+
+    const SessionTask task = RunSession(*this, *session);
+    session->handle = task.handle;
+
+    uint32_t id;
+    {
+        std::lock_guard lock(sessionsMutex);
+        id = nextSessionId++;
+        session->id = id;
+        sessions.push_back(std::move(session));
+    }
+    {
+        std::lock_guard lock(tickMutex);
+        waiting.push_back(task.handle);
+    }
+    return id;
+}
+
+SessionScheduler::Session *SessionScheduler::FindSession(const uint32_t id)
+{
+    const auto session = std::find_if(sessions.begin(), sessions.end(), [id](const auto &s) { return s->id == id; });
+    return session != sessions.end() ? session->get() : nullptr;
+}
+
+void SessionScheduler::QueueInput(Session &session, const std::bitset<16> &keypad)
+{
+    if (session.input.size() >= MAX_QUEUED_INPUTS)
+    {
+        session.input.pop_front();
+    }
+    session.input.push_back(keypad);
+}
+
+void SessionScheduler::PushInput(const uint32_t session, const std::bitset<16> &keypad)
+{
+    std::lock_guard sessionsLock(sessionsMutex);
+    if (Session *target = FindSession(session))
+    {
+        std::lock_guard lock(target->inputMutex);
+        QueueInput(*target, keypad);
+    }
+}
+
+void SessionScheduler::AttachInputFd(const uint32_t session, const int fd)
+{
+    std::lock_guard sessionsLock(sessionsMutex);
+    if (Session *target = FindSession(session))
+    {
+        std::lock_guard lock(target->inputMutex);
+        target->inputFd = fd;
+    }
+    else
+    {
+        close(fd);
+    }
+}
+
+void SessionScheduler::StopSession(const uint32_t session)
+{
+    std::lock_guard sessionsLock(sessionsMutex);
+    if (Session *target = FindSession(session))
+    {
+        target->stopRequested = true;
+    }
+}
+
+void SessionScheduler::ReadInputFd(Session &session)
+{
+    std::lock_guard lock(session.inputMutex);
+    if (session.inputFd < 0)
+    {
+        return;
+    }
+
+    // Poll with a zero timeout so that a quiet client never blocks a worker, and read at most one buffer per frame so
+    // that a client that keeps sending cannot hold one either
+    pollfd descriptor{session.inputFd, POLLIN, 0};
+    int pending;
+    do
+    {
+        pending = poll(&descriptor, 1, 0);
+    } while (pending < 0 && errno == EINTR);
+    if (pending > 0)
+    {
+        uint8_t buffer[MAX_INPUT_BYTES_PER_FRAME];
+        ssize_t result;
+        do
+        {
+            result = read(session.inputFd, buffer, sizeof(buffer));
+        } while (result < 0 && errno == EINTR);
+        if (result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            session.stopRequested = true;
+            return;
+        }
+        if (result > 0)
+        {
+            session.partialInput.insert(session.partialInput.end(), buffer, buffer + result);
+        }
+    }
+
+    size_t offset = 0;
+    for (; offset + 2 <= session.partialInput.size(); offset += 2)
+    {
+        QueueInput(session, session.partialInput[offset] | session.partialInput[offset + 1] << 8);
+    }
+    session.partialInput.erase(session.partialInput.begin(), session.partialInput.begin() + offset);
+}
+
+SessionScheduler::SessionTask SessionScheduler::RunSession(SessionScheduler &scheduler, Session &session)
+{
+    while (!session.stopRequested)
+    {
+        scheduler.ReadInputFd(session);
+        {
+            std::lock_guard lock(session.inputMutex);
+            if (!session.input.empty())
+            {
+                session.keypad = session.input.front();
+                session.input.pop_front();
+            }
+        }
+
+        session.instructionBudget += session.instructionsPerFrame;
+        while (session.instructionBudget >= 1.0 && !session.stopRequested)
+        {
+            // A bad ROM ends its own session instead of exiting the server
+            if (!IsKnownInstruction(PeekOpcode(session.chip8)))
+            {
+                session.stopRequested = true;
+                break;
+            }
+            try
+            {
+                FetchDecodeExecute(session.chip8, session.keypad, session.params);
+            }
+            catch (const MemoryTrap &trap)
+            {
+                std::cerr << "Session " << session.id << ": " << trap.what() << std::endl;
+                session.stopRequested = true;
+                break;
+            }
+            session.instructionBudget -= 1.0;
+        }
+        DecrementTimers(session.chip8);
+
+        const std::bitset<2048> changed = session.chip8.display ^ session.lastDisplay;
+        if (changed.any() && session.sink)
+        {
+            session.sink->OnFrame(session.id, session.frame, session.chip8.display, changed);
+        }
+        session.lastDisplay = session.chip8.display;
+        session.frame++;
+
+        co_await scheduler.NextFrame(session);
+    }
+}
+
+SessionScheduler::FrameAwaiter SessionScheduler::NextFrame(Session &session)
+{
+    return FrameAwaiter{*this, session};
+}
+
+void SessionScheduler::Park(const std::coroutine_handle<> handle)
+{
+    std::lock_guard lock(tickMutex);
+    waiting.push_back(handle);
+    running--;
+    if (running == 0)
+    {
+        idle.notify_all();
+    }
+}
+
+void SessionScheduler::Finished(Session &session)
+{
+    {
+        std::lock_guard lock(tickMutex);
+        running--;
+        if (running == 0)
+        {
+            idle.notify_all();
+        }
+    }
+    session.finished = true;
+}
+
+void SessionScheduler::Tick()
+{
+    // Reap sessions that ended since the last tick
+    {
+        std::lock_guard lock(sessionsMutex);
+        std::erase_if(sessions, [](const std::unique_ptr<Session> &session)
+        {
+            if (!session->finished)
+            {
+                return false;
+            }
+            session->handle.destroy();
+            if (session->inputFd >= 0)
+            {
+                close(session->inputFd);
+            }
+            return true;
+        });
+    }
+
+    std::vector<std::coroutine_handle<>> released;
+    {
+        std::lock_guard lock(tickMutex);
+        released.swap(waiting);
+        running += released.size();
+    }
+    {
+        std::lock_guard lock(queueMutex);
+        ready.insert(ready.end(), released.begin(), released.end());
+    }
+    queueNotEmpty.notify_all();
+}
+
+void SessionScheduler::WaitIdle()
+{
+    std::unique_lock lock(tickMutex);
+    idle.wait(lock, [this] { return running == 0; });
+}
+
+void SessionScheduler::Run(const std::atomic<bool> &stop)
+{
+    const auto frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1 / 60.0));
+    auto nextTick = std::chrono::steady_clock::now();
+    while (!stop)
+    {
+        Tick();
+        nextTick += frameInterval;
+        // After a stall, resynchronise instead of firing a burst of ticks
+        nextTick = std::max(nextTick, std::chrono::steady_clock::now() - frameInterval);
+        std::this_thread::sleep_until(nextTick);
+    }
+}
+
+size_t SessionScheduler::SessionCount()
+{
+    std::lock_guard lock(sessionsMutex);
+    return sessions.size();
+}
+
+void SessionScheduler::WorkerLoop()
+{
+    while (true)
+    {
+        std::unique_lock lock(queueMutex);
+        queueNotEmpty.wait(lock, [this] { return stopping || !ready.empty(); });
+        if (stopping)
+        {
+            return;
+        }
+        const std::coroutine_handle<> handle = ready.front();
+        ready.pop_front();
+        lock.unlock();
+
+        handle.resume();
+    }
+}
+
+void ServeUnixSocket(SessionScheduler &scheduler, const std::string &path, const std::span<const uint8_t> rom,
+                     const Params &params, const uint16_t ups, const std::atomic<bool> &stop)
+{
+    // Load first: a ROM the checked build rejects must not leave a socket behind
+    Chip8 initial;
+    LoadFontsIntoMemory(initial);
+    LoadRomIntoMemory(initial, rom);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Failed to create socket" << std::endl;
+        exit(1);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    // Only a stale socket from an earlier run may be replaced, never e.g. a mistyped path to a regular file
+    struct stat status{};
+    if (lstat(path.c_str(), &status) == 0)
+    {
+        if (!S_ISSOCK(status.st_mode))
+        {
+            std::cerr << path << " exists and is not a socket" << std::endl;
+            close(listener);
+            exit(1);
+        }
+        unlink(path.c_str());
+    }
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listener, 64) < 0)
+    {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+
+    std::thread ticker(&SessionScheduler::Run, &scheduler, std::cref(stop));
+    pollfd descriptor{listener, POLLIN, 0};
+    while (!stop)
+    {
+        // Wake up regularly to notice stop
+        if (poll(&descriptor, 1, 100) <= 0)
+        {
+            continue;
+        }
+        const int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+        {
+            continue;
+        }
+        // The sink and the input reader each own a descriptor for the same connection
+        Chip8 chip8 = initial;
+        SeedRandom(chip8, std::random_device{}());
+        const uint32_t session = scheduler.AddSession(chip8, params, ups, std::make_shared<FdFrameSink>(dup(client)));
+        scheduler.AttachInputFd(session, client);
+    }
+    ticker.join();
+    close(listener);
+    unlink(path.c_str());
+}
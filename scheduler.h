@@ -0,0 +1,191 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "interpreter.h"
+
+// Receives a session's display after every frame in which it changed
+class FrameSink
+{
+public:
+    virtual ~FrameSink() = default;
+
+    // changed has a bit set for every pixel that flipped since the previous frame
+    virtual void OnFrame(uint32_t session, uint64_t frame, const std::bitset<2048> &display,
+                         const std::bitset<2048> &changed) = 0;
+};
+
+// Streams frame diffs to a pipe or socket. Each message is
+// [uint32 session][uint64 frame][uint32 changed row mask] followed by one uint64 per changed row (bit 0 = column 0),
+// all little-endian.
+// Writes never block the worker: a client that falls more than MAX_BACKLOG bytes behind misses frames, and once it
+// catches up the next message carries every row so that its picture is whole again.
+class FdFrameSink : public FrameSink
+{
+public:
+    static constexpr size_t MAX_BACKLOG = 64 * 1024;
+
+    // Takes ownership of fd and makes it non-blocking
+    explicit FdFrameSink(int fd);
+
+    ~FdFrameSink() override;
+
+    void OnFrame(uint32_t session, uint64_t frame, const std::bitset<2048> &display,
+                 const std::bitset<2048> &changed) override;
+
+private:
+    // Writes as much of the backlog as the descriptor takes without blocking, false if the client is gone
+    bool Flush();
+
+    const int fd;
+    std::mutex writeMutex;
+    // Bytes the client has not accepted yet, always whole messages except for the first one
+    std::vector<uint8_t> backlog;
+    // Set when a frame was dropped, so the next one sends every row
+    bool resync = false;
+    bool closed = false;
+};
+
+// Runs every Chip8 session as a coroutine that executes one frame's instruction budget and then waits for the next
+// frame tick, so thousands of sessions share a few worker threads instead of one thread and window each.
+class SessionScheduler
+{
+public:
+    // Keypad states a session holds on to, older ones are dropped first
+    static constexpr size_t MAX_QUEUED_INPUTS = 64;
+    // Bytes read from an input descriptor per frame, the rest waits for the next frame
+    static constexpr size_t MAX_INPUT_BYTES_PER_FRAME = 64;
+
+    explicit SessionScheduler(size_t threads = std::thread::hardware_concurrency());
+
+    // Stops the workers and destroys every session
+    ~SessionScheduler();
+
+    SessionScheduler(const SessionScheduler &) = delete;
+    SessionScheduler &operator=(const SessionScheduler &) = delete;
+
+    // The session starts on the next Tick. Returns its id.
+    uint32_t AddSession(const Chip8 &initial, const Params &params, uint16_t ups, std::shared_ptr<FrameSink> sink);
+
+    // Queues a keypad state, sessions consume one queued state per frame so that short taps are not lost.
+    // Beyond MAX_QUEUED_INPUTS the oldest state is dropped.
+    void PushInput(uint32_t session, const std::bitset<16> &keypad);
+
+    // Reads uint16 little-endian keypad masks from fd before every frame, the session ends when fd reaches EOF.
+    // Takes ownership of fd.
+    void AttachInputFd(uint32_t session, int fd);
+
+    void StopSession(uint32_t session);
+
+    // Releases every waiting session for one frame. Sessions still busy with the previous frame skip this one.
+    void Tick();
+
+    // Blocks until every session released by the last Tick is waiting again
+    void WaitIdle();
+
+    // Ticks at 60Hz until stop is set
+    void Run(const std::atomic<bool> &stop);
+
+    size_t SessionCount();
+
+private:
+    typedef struct session
+    {
+        uint32_t id;
+        Chip8 chip8;
+        Params params;
+        double instructionsPerFrame;
+        double instructionBudget = 0.0;
+        std::shared_ptr<FrameSink> sink;
+        std::bitset<16> keypad;
+        std::bitset<2048> lastDisplay;
+        uint64_t frame = 0;
+
+        std::mutex inputMutex;
+        std::deque<std::bitset<16>> input;
+        int inputFd = -1;
+        // Bytes of an incomplete keypad mask read from inputFd
+        std::vector<uint8_t> partialInput;
+
+        std::atomic<bool> stopRequested = false;
+        // Set once the coroutine is suspended for good and can be destroyed
+        std::atomic<bool> finished = false;
+        std::coroutine_handle<> handle;
+    } Session;
+
+    class SessionTask
+    {
+    public:
+        struct promise_type;
+
+        explicit SessionTask(std::coroutine_handle<promise_type> handle);
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // co_await NextFrame(session) suspends the session until the next Tick
+    struct FrameAwaiter
+    {
+        SessionScheduler &scheduler;
+        Session &session;
+
+        bool await_ready() const noexcept;
+
+        void await_suspend(std::coroutine_handle<> handle);
+
+        void await_resume() const noexcept;
+    };
+
+    static SessionTask RunSession(SessionScheduler &scheduler, Session &session);
+
+    FrameAwaiter NextFrame(Session &session);
+
+    // Caller holds sessionsMutex, so that Tick cannot reap the session meanwhile
+    Session *FindSession(uint32_t id);
+
+    void ReadInputFd(Session &session);
+
+    // Caller holds session.inputMutex
+    static void QueueInput(Session &session, const std::bitset<16> &keypad);
+
+    void Park(std::coroutine_handle<> handle);
+
+    void Finished(Session &session);
+
+    void WorkerLoop();
+
+    std::mutex sessionsMutex;
+    std::vector<std::unique_ptr<Session>> sessions;
+    uint32_t nextSessionId = 0;
+
+    // Sessions suspended until the next tick, and how many released ones are still running
+    std::mutex tickMutex;
+    std::condition_variable idle;
+    std::vector<std::coroutine_handle<>> waiting;
+    size_t running = 0;
+
+    std::mutex queueMutex;
+    std::condition_variable queueNotEmpty;
+    std::deque<std::coroutine_handle<>> ready;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+// Accepts clients on a Unix socket until stop is set, each connection becomes a session running the ROM.
+// The socket carries keypad masks from the client and frame diffs (see FdFrameSink) back to it.
+void ServeUnixSocket(SessionScheduler &scheduler, const std::string &path, std::span<const uint8_t> rom,
+                     const Params &params, uint16_t ups, const std::atomic<bool> &stop);
+
+#endif //SCHEDULER_H
@@ -0,0 +1,160 @@
+#include "sharedframe.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    SharedFrame *MapSegment(const int fd)
+    {
+        void *mapping = mmap(nullptr, sizeof(SharedFrame), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return mapping != MAP_FAILED ? static_cast<SharedFrame *>(mapping) : nullptr;
+    }
+}
+
+SharedFrameExport::SharedFrameExport(const std::string &name) : name(name)
+{
+    // O_EXCL: never attach to a segment another emulator is still publishing into
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create shared memory " << name << ": " << std::strerror(errno);
+        if (errno == EEXIST)
+        {
+            std::cerr << " (another emulator is using it, or a crashed one left /dev/shm" << name << " behind)";
+        }
+        std::cerr << std::endl;
+        exit(1);
+    }
+    if (ftruncate(fd, sizeof(SharedFrame)) < 0 || !(shared = MapSegment(fd)))
+    {
+        std::cerr << "Failed to map shared memory " << name << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        shm_unlink(name.c_str());
+        exit(1);
+    }
+    close(fd);
+
+    // Viewers load the magic first with acquire, so they never see a half-initialised segment as valid
+    shared->sequence.store(0, std::memory_order_relaxed);
+    shared->frame.store(0, std::memory_order_relaxed);
+    shared->injectedKeypad.store(0, std::memory_order_relaxed);
+    shared->version.store(SHARED_FRAME_VERSION, std::memory_order_relaxed);
+    shared->magic.store(SHARED_FRAME_MAGIC, std::memory_order_release);
+}
+
+SharedFrameExport::~SharedFrameExport()
+{
+    munmap(shared, sizeof(SharedFrame));
+    shm_unlink(name.c_str());
+}
+
+void SharedFrameExport::Publish(const Chip8 &chip8, const std::bitset<16> &keypad, const uint64_t frame)
+{
+    // Single writer, so the sequence only needs to be ordered against the data, not incremented atomically
+    const uint32_t sequence = shared->sequence.load(std::memory_order_relaxed);
+    shared->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    shared->frame.store(frame, std::memory_order_relaxed);
+    for (uint8_t row = 0; row < 32; row++)
+    {
+        shared->display[row].store(DisplayRow(chip8.display, row), std::memory_order_relaxed);
+    }
+    shared->keypad.store(keypad.to_ulong(), std::memory_order_relaxed);
+    shared->delayTimer.store(chip8.delayTimer, std::memory_order_relaxed);
+    shared->soundTimer.store(chip8.soundTimer, std::memory_order_relaxed);
+
+    shared->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::bitset<16> SharedFrameExport::InjectedKeypad() const
+{
+    return shared->injectedKeypad.load(std::memory_order_relaxed);
+}
+
+SharedFrameView::SharedFrameView(const std::string &name)
+{
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+    {
+        return;
+    }
+    // The creator sizes the segment only after creating it, touching a mapping past its end raises SIGBUS
+    struct stat status{};
+    if (fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) >= sizeof(SharedFrame))
+    {
+        shared = MapSegment(fd);
+    }
+    close(fd);
+
+    if (shared && (shared->magic.load(std::memory_order_acquire) != SHARED_FRAME_MAGIC ||
+                   shared->version.load(std::memory_order_relaxed) != SHARED_FRAME_VERSION))
+    {
+        munmap(shared, sizeof(SharedFrame));
+        shared = nullptr;
+    }
+}
+
+SharedFrameView::~SharedFrameView()
+{
+    if (shared)
+    {
+        munmap(shared, sizeof(SharedFrame));
+    }
+}
+
+bool SharedFrameView::IsOpen() const
+{
+    return shared != nullptr;
+}
+
+uint64_t SharedFrameView::Frame() const
+{
+    return shared->frame.load(std::memory_order_relaxed);
+}
+
+std::optional<SharedFrameSnapshot> SharedFrameView::Read() const
+{
+    SharedFrameSnapshot snapshot{};
+    uint64_t rows[32];
+    uint32_t before, after;
+    uint32_t attempts = 0;
+    do
+    {
+        if (attempts++ == MAX_READ_ATTEMPTS)
+        {
+            return std::nullopt;
+        }
+        before = shared->sequence.load(std::memory_order_acquire);
+        snapshot.frame = shared->frame.load(std::memory_order_relaxed);
+        for (uint8_t row = 0; row < 32; row++)
+        {
+            rows[row] = shared->display[row].load(std::memory_order_relaxed);
+        }
+        snapshot.keypad = shared->keypad.load(std::memory_order_relaxed);
+        snapshot.delayTimer = shared->delayTimer.load(std::memory_order_relaxed);
+        snapshot.soundTimer = shared->soundTimer.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = shared->sequence.load(std::memory_order_relaxed);
+    } while (before != after || before & 1);
+
+    // Unpacking happens outside the retry loop, so a busy writer costs readers as little as possible
+    for (uint8_t row = 0; row < 32; row++)
+    {
+        for (uint8_t column = 0; column < 64; column++)
+        {
+            snapshot.display[row * 64 + column] = rows[row] >> column & 1;
+        }
+    }
+    return snapshot;
+}
+
+void SharedFrameView::Inject(const std::bitset<16> &keypad)
+{
+    shared->injectedKeypad.store(keypad.to_ulong(), std::memory_order_relaxed);
+}
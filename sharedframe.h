@@ -0,0 +1,98 @@
+#ifndef SHAREDFRAME_H
+#define SHAREDFRAME_H
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "interpreter.h"
+
+constexpr uint32_t SHARED_FRAME_MAGIC = 0x43384652; // "C8FR"
+constexpr uint32_t SHARED_FRAME_VERSION = 1;
+
+// Layout of the POSIX shared-memory segment. Everything is atomic because the segment is shared across processes,
+// which is only sound for lock-free atomics.
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free &&
+              std::atomic<uint16_t>::is_always_lock_free && std::atomic<uint8_t>::is_always_lock_free);
+
+typedef struct sharedFrame
+{
+    // Stored last with release when the segment is created, viewers load it first with acquire
+    std::atomic<uint32_t> magic;
+    std::atomic<uint32_t> version;
+    // Seqlock: odd while the emulator is writing, readers retry until they see the same even value on both sides
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint64_t> frame;
+    // One word per row, bit 0 is column 0 (see DisplayRow)
+    std::atomic<uint64_t> display[32];
+    // Keypad the last frame ran with
+    std::atomic<uint16_t> keypad;
+    std::atomic<uint8_t> delayTimer;
+    std::atomic<uint8_t> soundTimer;
+    // Written by external processes, outside the seqlock. The emulator uses it as the keypad for the next frame.
+    std::atomic<uint16_t> injectedKeypad;
+} SharedFrame;
+
+typedef struct sharedFrameSnapshot
+{
+    uint64_t frame;
+    std::bitset<2048> display;
+    std::bitset<16> keypad;
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+} SharedFrameSnapshot;
+
+// Emulator side: creates the segment and publishes every frame into it. The segment is removed on destruction.
+class SharedFrameExport
+{
+public:
+    // name follows shm_open rules, e.g. "/chip8". Exits if a segment of that name already exists, since two
+    // emulators writing one segment would corrupt each other's frames.
+    explicit SharedFrameExport(const std::string &name);
+
+    ~SharedFrameExport();
+
+    SharedFrameExport(const SharedFrameExport &) = delete;
+    SharedFrameExport &operator=(const SharedFrameExport &) = delete;
+
+    void Publish(const Chip8 &chip8, const std::bitset<16> &keypad, uint64_t frame);
+
+    std::bitset<16> InjectedKeypad() const;
+
+private:
+    const std::string name;
+    SharedFrame *shared = nullptr;
+};
+
+// Viewer, recorder or bot side: attaches to a segment created by SharedFrameExport
+class SharedFrameView
+{
+public:
+    // Attempts Read makes before it gives up on a writer that stays mid-publish, e.g. because it died there
+    static constexpr uint32_t MAX_READ_ATTEMPTS = 10000;
+
+    explicit SharedFrameView(const std::string &name);
+
+    ~SharedFrameView();
+
+    SharedFrameView(const SharedFrameView &) = delete;
+    SharedFrameView &operator=(const SharedFrameView &) = delete;
+
+    // False if the segment does not exist, is not sized yet or was written by an incompatible version
+    bool IsOpen() const;
+
+    // Latest published frame number, a single load for cheap polling
+    uint64_t Frame() const;
+
+    // Consistent copy of the latest frame, retries while the emulator is in the middle of publishing.
+    // Empty after MAX_READ_ATTEMPTS torn reads.
+    std::optional<SharedFrameSnapshot> Read() const;
+
+    void Inject(const std::bitset<16> &keypad);
+
+private:
+    SharedFrame *shared = nullptr;
+};
+
+#endif //SHAREDFRAME_H
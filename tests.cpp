@@ -1,9 +1,26 @@
+#include <algorithm>
 #include <assert.h>
+#include <bit>
+#include <fcntl.h>
+#include <filesystem>
 #include <format>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
 
+#include "capture.h"
+#include "differential.h"
 #include "interpreter.h"
+#include "latency.h"
+#include "romlibrary.h"
+#include "scheduler.h"
+#include "sharedframe.h"
 
 // https://johnearnest.github.io/Octo/
 uint8_t CHIP8_LOGO_INSTRUCTIONS[] = {
@@ -51,10 +68,695 @@ void TestLoadRomIntoMemory(Chip8 &chip8, const std::string &rom_file, const uint
 		}
 }
 
+// Runs a hostile instruction at ROM_ADDRESS_START: checked builds must trap on it, release builds must wrap around
+// memory and the stack. Returns the machine afterwards (trapped machines are left mid-instruction).
+Chip8 RunOutOfRange(Chip8 chip8, const uint8_t byte1, const uint8_t byte2, const uint16_t index, const int steps) {
+	chip8.memory[ROM_ADDRESS_START] = byte1;
+	chip8.memory[ROM_ADDRESS_START + 1] = byte2;
+	chip8.programCounter = ROM_ADDRESS_START;
+	chip8.index = index;
+#ifdef CHIP8_CHECKED_MEMORY
+	bool trapped = false;
+	try {
+		for (int i = 0; i < steps; i++) {
+			FetchDecodeExecute(chip8, {}, {});
+		}
+	} catch (const MemoryTrap &trap) {
+		trapped = true;
+		assert(trap.programCounter == ROM_ADDRESS_START && "TestOutOfRangeAccess failed");
+		assert(trap.opcode == ((byte1 << 8) | byte2) && "TestOutOfRangeAccess failed");
+	}
+	assert(trapped && "TestOutOfRangeAccess failed");
+#else
+	for (int i = 0; i < steps; i++) {
+		FetchDecodeExecute(chip8, {}, {});
+	}
+	assert(chip8.sp < STACK_SIZE && "TestOutOfRangeAccess failed");
+#endif
+	return chip8;
+}
+
+void TestOutOfRangeAccess() {
+	Chip8 base;
+	std::fill_n(base.registers, 16, 0xAB);
+
+	// 2200: recursive call overflows the stack, the 17th return address overwrites the 1st
+	[[maybe_unused]] const Chip8 overflow = RunOutOfRange(base, 0x22, 0x00, 0, STACK_SIZE + 1);
+	// 00EE: return with an empty stack pops the top slot
+	[[maybe_unused]] const Chip8 underflow = RunOutOfRange(base, 0x00, 0xEE, 0, 1);
+
+	// FF55: store V0 - VF from 0xFFA onwards, V6 - VF land at 0x000 - 0x009
+	Chip8 storeBase = base;
+	for (uint8_t i = 0; i < 16; i++) {
+		storeBase.registers[i] = 0x10 + i;
+	}
+	[[maybe_unused]] const Chip8 store = RunOutOfRange(storeBase, 0xFF, 0x55, 0xFFA, 1);
+
+	// FF65: load V0 - VF from 0xFFA onwards, V6 - VF come from 0x000 - 0x009
+	Chip8 loadBase = base;
+	for (uint16_t i = 0; i < 6; i++) {
+		loadBase.memory[0xFFA + i] = 0x20 + i;
+	}
+	for (uint16_t i = 0; i < 10; i++) {
+		loadBase.memory[i] = 0x30 + i;
+	}
+	[[maybe_unused]] const Chip8 load = RunOutOfRange(loadBase, 0xFF, 0x65, 0xFFA, 1);
+
+	// D01F: 15-row sprite from 0xFFE, rows 2 onwards come from 0x000
+	Chip8 drawBase = base;
+	drawBase.memory[0xFFE] = 0x80;
+	drawBase.memory[0xFFF] = 0x00;
+	drawBase.memory[0x000] = 0x80;
+	[[maybe_unused]] const Chip8 draw = RunOutOfRange(drawBase, 0xD0, 0x1F, 0xFFE, 1);
+
+	// F033: BCD of 0xAB (171) at 0xFFE, the ones digit wraps to 0x000
+	[[maybe_unused]] const Chip8 bcd = RunOutOfRange(base, 0xF0, 0x33, 0xFFE, 1);
+
+#ifndef CHIP8_CHECKED_MEMORY
+	assert(overflow.stack[0] == ROM_ADDRESS_START + 2 && overflow.sp == 1 && "TestOutOfRangeAccess failed");
+	assert(underflow.sp == STACK_SIZE - 1 && underflow.programCounter == 0 && "TestOutOfRangeAccess failed");
+	for (uint8_t i = 0; i < 16; i++) {
+		assert(store.memory[(0xFFA + i) & 0xFFF] == 0x10 + i && "TestOutOfRangeAccess failed");
+	}
+	for (uint8_t i = 0; i < 16; i++) {
+		assert(load.registers[i] == (i < 6 ? 0x20 + i : 0x30 + i - 6) && "TestOutOfRangeAccess failed");
+	}
+	// V0 = V1 = 0xAB puts the sprite at x = 43, y = 11
+	assert(draw.display.test(11 * 64 + 43) && !draw.display.test(12 * 64 + 43) && draw.display.test(13 * 64 + 43) &&
+		"TestOutOfRangeAccess failed");
+	assert(draw.display.count() == 2 && "TestOutOfRangeAccess failed");
+	assert(bcd.memory[0xFFE] == 1 && bcd.memory[0xFFF] == 7 && bcd.memory[0x000] == 1 && "TestOutOfRangeAccess failed");
+#endif
+}
+
+// ROMs larger than the memory above ROM_ADDRESS_START are clamped (or rejected by the checked build)
+void TestOversizedRom() {
+	const std::string rom_file = "oversized.ch8";
+	{
+		std::ofstream rom(rom_file, std::ios::binary);
+		for (uint16_t i = 0; i < 5000; i++) {
+			rom.put(static_cast<char>(i & 0xFF));
+		}
+	}
+	Chip8 chip8;
+#ifdef CHIP8_CHECKED_MEMORY
+	bool trapped = false;
+	try {
+		LoadRomIntoMemory(chip8, rom_file);
+	} catch (const MemoryTrap &) {
+		trapped = true;
+	}
+	assert(trapped && "TestOversizedRom failed");
+#else
+	assert(LoadRomIntoMemory(chip8, rom_file) == MEMORY_SIZE - ROM_ADDRESS_START && "TestOversizedRom failed");
+	assert(chip8.memory[MEMORY_SIZE - 1] == ((MEMORY_SIZE - ROM_ADDRESS_START - 1) & 0xFF) && "TestOversizedRom failed");
+	// Nothing past the end of memory: the rest of the machine is untouched
+	assert(chip8.display.none() && chip8.programCounter == ROM_ADDRESS_START && "TestOversizedRom failed");
+#endif
+	std::filesystem::remove(rom_file);
+}
+
+// Unchanged frames must not produce a new image
+void TestCaptureDeduplication() {
+	const std::string output = "capture_test";
+	std::filesystem::remove_all(output);
+	{
+		CaptureOptions options{};
+		options.format = CaptureFormat::Pbm;
+		options.output = output;
+		options.scale = 2;
+		FrameCapture capture(options);
+		std::bitset<2048> display;
+		capture.Submit(display);
+		capture.Submit(display);
+		display.set(0);
+		capture.Submit(display);
+	}
+	assert(std::filesystem::exists(output + "/frame_000000.pbm") && "TestCaptureDeduplication failed");
+	assert(!std::filesystem::exists(output + "/frame_000001.pbm") && "TestCaptureDeduplication failed");
+	assert(std::filesystem::exists(output + "/frame_000002.pbm") && "TestCaptureDeduplication failed");
+
+	// 128 x 64 at 1 bit per pixel, top left 2 x 2 block lit (white, so 0 bits)
+	std::ifstream image(output + "/frame_000002.pbm", std::ios::binary);
+	std::string magic;
+	uint32_t width, height;
+	image >> magic >> width >> height;
+	image.get();
+	assert(magic == "P4" && width == 128 && height == 64 && "TestCaptureDeduplication failed");
+	assert(image.get() == 0x3F && "TestCaptureDeduplication failed");
+	std::filesystem::remove_all(output);
+}
+
+uint32_t ReadBigEndian(const std::vector<uint8_t> &bytes, const size_t offset) {
+	return bytes[offset] << 24 | bytes[offset + 1] << 16 | bytes[offset + 2] << 8 | bytes[offset + 3];
+}
+
+// Bitwise CRC-32, independent of the table-driven one in capture.cpp
+uint32_t ReferenceCrc32(const uint8_t *data, const size_t length) {
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+// PNG chunks must carry valid CRCs and the stored deflate blocks must reassemble into the filtered scanlines
+void TestCapturePng() {
+	const std::string output = "capture_png_test";
+	std::filesystem::remove_all(output);
+	{
+		CaptureOptions options{};
+		options.format = CaptureFormat::Png;
+		options.output = output;
+		// 256 x 128 RGB is larger than one stored block
+		options.scale = 4;
+		options.rgb = true;
+		FrameCapture capture(options);
+		std::bitset<2048> display;
+		display.set(65);
+		capture.Submit(display);
+	}
+	std::ifstream image(output + "/frame_000000.png", std::ios::binary);
+	const std::vector<uint8_t> png((std::istreambuf_iterator<char>(image)), std::istreambuf_iterator<char>());
+	assert(png.size() > 8 && png[0] == 0x89 && png[1] == 'P' && "TestCapturePng failed");
+
+	std::vector<uint8_t> zlib;
+	std::vector<std::string> chunks;
+	for (size_t offset = 8; offset < png.size();) {
+		const uint32_t length = ReadBigEndian(png, offset);
+		assert(offset + 12 + length <= png.size() && "TestCapturePng failed");
+		// The CRC covers the chunk type and data
+		assert(ReadBigEndian(png, offset + 8 + length) == ReferenceCrc32(png.data() + offset + 4, length + 4) &&
+			"TestCapturePng failed");
+		const std::string type(png.begin() + offset + 4, png.begin() + offset + 8);
+		if (type == "IHDR") {
+			assert(ReadBigEndian(png, offset + 8) == 256 && ReadBigEndian(png, offset + 12) == 128 &&
+				png[offset + 17] == 2 && "TestCapturePng failed");
+		} else if (type == "IDAT") {
+			zlib.insert(zlib.end(), png.begin() + offset + 8, png.begin() + offset + 8 + length);
+		}
+		chunks.push_back(type);
+		offset += 12 + length;
+	}
+	assert((chunks == std::vector<std::string>{"IHDR", "IDAT", "IEND"}) && "TestCapturePng failed");
+
+	// Stored blocks: BFINAL/BTYPE byte, then LEN and its one's complement NLEN, little-endian
+	assert(zlib.size() > 6 && zlib[0] == 0x78 && (zlib[0] << 8 | zlib[1]) % 31 == 0 && "TestCapturePng failed");
+	std::vector<uint8_t> raw;
+	size_t offset = 2;
+	int blocks = 0;
+	bool last = false;
+	while (!last) {
+		assert(offset + 5 <= zlib.size() && (zlib[offset] & 0x06) == 0 && "TestCapturePng failed");
+		last = zlib[offset] & 1;
+		const uint16_t length = zlib[offset + 1] | zlib[offset + 2] << 8;
+		const uint16_t inverse = zlib[offset + 3] | zlib[offset + 4] << 8;
+		assert(static_cast<uint16_t>(~length) == inverse && "TestCapturePng failed");
+		raw.insert(raw.end(), zlib.begin() + offset + 5, zlib.begin() + offset + 5 + length);
+		offset += 5 + length;
+		blocks++;
+	}
+	assert(blocks == 2 && offset + 4 == zlib.size() && "TestCapturePng failed");
+
+	const size_t stride = 1 + 256 * 3;
+	assert(raw.size() == stride * 128 && "TestCapturePng failed");
+	// Pixel 65 is column 1 of row 1, so scaled rows 4 - 7 have bytes 12 - 23 lit
+	for (size_t y = 0; y < 128; y++) {
+		assert(raw[y * stride] == 0 && "TestCapturePng failed");
+		for (size_t x = 0; x < 256 * 3; x++) {
+			const bool lit = y >= 4 && y < 8 && x >= 12 && x < 24;
+			assert(raw[y * stride + 1 + x] == (lit ? 0xFF : 0x00) && "TestCapturePng failed");
+		}
+	}
+
+	uint32_t a = 1, b = 0;
+	for (const uint8_t byte: raw) {
+		a = (a + byte) % 65521;
+		b = (b + a) % 65521;
+	}
+	assert(ReadBigEndian(zlib, offset) == (b << 16 | a) && "TestCapturePng failed");
+	std::filesystem::remove_all(output);
+}
+
+// Y4M writes every frame, repeats included: header, then "FRAME\n", luma and two quarter-size chroma planes each
+void TestCaptureY4m() {
+	const std::string output = "capture_test.y4m";
+	{
+		CaptureOptions options{};
+		options.format = CaptureFormat::Y4m;
+		options.output = output;
+		options.scale = 2;
+		FrameCapture capture(options);
+		std::bitset<2048> display;
+		capture.Submit(display);
+		capture.Submit(display);
+		display.set(0);
+		capture.Submit(display);
+	}
+	const std::string header = "YUV4MPEG2 W128 H64 F60:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n";
+	std::ifstream video(output, std::ios::binary);
+	const std::string contents((std::istreambuf_iterator<char>(video)), std::istreambuf_iterator<char>());
+	const size_t frameSize = 6 + 128 * 64 + 128 * 64 / 2;
+	assert(contents.size() == header.size() + 3 * frameSize && "TestCaptureY4m failed");
+	assert(contents.compare(0, header.size(), header) == 0 && "TestCaptureY4m failed");
+	assert(contents.compare(header.size() + 2 * frameSize, 6, "FRAME\n") == 0 && "TestCaptureY4m failed");
+	// Top left 2 x 2 block of the last frame is lit
+	assert(static_cast<uint8_t>(contents[header.size() + 2 * frameSize + 6]) == 0xFF && "TestCaptureY4m failed");
+	video.close();
+	std::filesystem::remove(output);
+}
+
+// A ROM that ends in an unknown instruction must stop the run, not the process, so every frame reaches the capture
+void TestCaptureUnknownInstruction() {
+	// Count V1 to 200, draw the 0 glyph at (0, 0), then hit 0001
+	const uint8_t program[] = {
+		0xA0, FONT_ADDRESS_START, 0x60, 0x00, 0x61, 0x00, 0x71, 0x01, 0x31, 0xC8, 0x12, 0x06, 0xD0, 0x05, 0x00, 0x01,
+	};
+	Chip8 chip8;
+	LoadFontsIntoMemory(chip8);
+	LoadRomIntoMemory(chip8, program);
+
+	const std::string output = "capture_unknown.y4m";
+	uint64_t frames = 0;
+	{
+		CaptureOptions options{};
+		options.format = CaptureFormat::Y4m;
+		options.output = output;
+		// Deep enough that the writer is certain to lag behind
+		options.queueDepth = 1024;
+		FrameCapture capture(options);
+		RunHeadless(240, chip8, {}, 2000, [&](Chip8 &machine, std::bitset<16> &) {
+			capture.Submit(machine.display);
+			frames++;
+			return true;
+		});
+	}
+	assert(chip8.programCounter == ROM_ADDRESS_START + 14 && frames > 100 && frames < 2000 &&
+		"TestCaptureUnknownInstruction failed");
+
+	const std::string header = "YUV4MPEG2 W64 H32 F60:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n";
+	const size_t frameSize = 6 + 64 * 32 + 64 * 32 / 2;
+	std::ifstream video(output, std::ios::binary);
+	const std::string contents((std::istreambuf_iterator<char>(video)), std::istreambuf_iterator<char>());
+	assert(contents.size() == header.size() + frames * frameSize && "TestCaptureUnknownInstruction failed");
+	// The glyph drawn in the last frame made it into the file
+	assert(static_cast<uint8_t>(contents[header.size() + (frames - 1) * frameSize + 6]) == 0xFF &&
+		"TestCaptureUnknownInstruction failed");
+	video.close();
+	std::filesystem::remove(output);
+}
+
+// A game that polls the keypad and animates every frame only reflects an edge once it does something different
+void TestLatencyTracker() {
+	using namespace std::chrono_literals;
+	// Every frame: wait for the delay timer, toggle pixel (0, 0), and count frames with key 0 held in V4.
+	// The third such frame draws at (10, 10).
+	const uint8_t program[] = {
+		0x66, 0x01, 0xF6, 0x15, 0xF7, 0x07, 0x37, 0x00, 0x12, 0x04, 0xD0, 0x11, 0xE5, 0xA1, 0x74, 0x01,
+		0x34, 0x03, 0x12, 0x00, 0xD2, 0x31, 0x12, 0x00,
+	};
+	Chip8 chip8;
+	LoadRomIntoMemory(chip8, program);
+	chip8.memory[0x300] = 0x80;
+	chip8.index = 0x300;
+	chip8.registers[2] = 10;
+	chip8.registers[3] = 10;
+
+	LatencyTracker latency;
+	const LatencyTracker::Clock::time_point start{};
+	std::bitset<16> keypad, sampled;
+	std::bitset<2048> lastDisplay;
+	int64_t reactionFrame = -1;
+	// Runs one frame of the late-sampling loop, presenting it at (frame + 1) * 10 ms
+	const auto runFrame = [&](const int64_t frame) {
+		latency.KeypadSampled(chip8, sampled);
+		sampled = keypad;
+		for (int i = 0; i < 20; i++) {
+			FetchDecodeExecute(chip8, sampled, {});
+			latency.InstructionExecuted({});
+		}
+		DecrementTimers(chip8);
+		latency.TimersDecremented();
+		latency.FramePresented(chip8.display, start + (frame + 1) * 10ms);
+		if (frame > 2) {
+			assert(chip8.display != lastDisplay && "TestLatencyTracker failed");
+		}
+		lastDisplay = chip8.display;
+		if (reactionFrame < 0 && chip8.display.test(10 * 64 + 10)) {
+			reactionFrame = frame;
+		}
+	};
+
+	int64_t frame = 0;
+	for (; frame < 5; frame++) {
+		runFrame(frame);
+	}
+	latency.KeypadChanged(keypad, 0b1, start + 45ms);
+	keypad = 0b1;
+	for (; frame < 12; frame++) {
+		runFrame(frame);
+	}
+	// Not the next present, which differs from the previous one anyway, but the first frame drawing the reaction
+	assert(reactionFrame >= 7 && "TestLatencyTracker failed");
+	assert(latency.Answered() == 1 && latency.Percentile(50) == (reactionFrame + 1) * 10 - 45 &&
+		"TestLatencyTracker failed");
+
+	// A tap released before the next sample never reaches the machine and times out
+	latency.KeypadChanged(keypad, 0b0, start + 125ms);
+	latency.KeypadChanged(0b0, 0b1, start + 126ms);
+	for (uint32_t i = 0; i <= LatencyTracker::MAX_FRAMES_WAITED; i++) {
+		runFrame(frame++);
+	}
+	assert(latency.Answered() == 1 && latency.Unanswered() == 2 && "TestLatencyTracker failed");
+}
+
+// Mapped ROMs must hash like sha1sum and load the same bytes as the file path
+void TestRomLibrary(const std::string &directory) {
+	assert(Sha1({}) == "da39a3ee5e6b4b0d3255bfef95601890afd80709" && "TestRomLibrary failed");
+	const std::string abc = "abc";
+	assert(Sha1({reinterpret_cast<const uint8_t *>(abc.data()), abc.size()}) ==
+		"a9993e364706816aba3e25717850c26c9cd0d89d" && "TestRomLibrary failed");
+
+	// Padding spills into a second block from 56 bytes on, and inputs of whole blocks are hashed in place
+	const std::string a55(55, 'a'), a56(56, 'a'), a64(64, 'a');
+	assert(Sha1({reinterpret_cast<const uint8_t *>(a55.data()), a55.size()}) ==
+		"c1c8bbdc22796e28c0e15163d20899b65621d65a" && "TestRomLibrary failed");
+	assert(Sha1({reinterpret_cast<const uint8_t *>(a56.data()), a56.size()}) ==
+		"c2db330f6083854c99d4b5bfb6e8f29f201be699" && "TestRomLibrary failed");
+	assert(Sha1({reinterpret_cast<const uint8_t *>(a64.data()), a64.size()}) ==
+		"0098ba824b5c16427bd7a1122a5a442a25ec644d" && "TestRomLibrary failed");
+
+	const RomLibrary library(directory);
+	const MappedRom *ibm = library.Find("b9bbc12cee3f7b9d3b1f69161f7d7a2d86953379");
+	assert(ibm && !LookupQuirks(ibm->Hash()) && "TestRomLibrary failed");
+
+	// The shipped database knows the test suite ROMs
+	assert(LoadQuirkDatabase(DEFAULT_QUIRK_DATABASE) >= 2 && "TestRomLibrary failed");
+	const Params *shipped = LookupQuirks(ibm->Hash());
+	assert(shipped && !shipped->shift && !shipped->jumpWithOffset && "TestRomLibrary failed");
+
+	// Hashes are matched case-insensitively, comments and blank lines are skipped
+	const std::string database_file = "quirks_test.txt";
+	{
+		std::ofstream database(database_file);
+		database << "# test database\n\nB9BBC12CEE3F7B9D3B1F69161F7D7A2D86953379 -shift -loadIncrementIndex # IBM logo\n";
+	}
+	assert(LoadQuirkDatabase(database_file) == 1 && "TestRomLibrary failed");
+	const Params *quirks = LookupQuirks(ibm->Hash());
+	assert(quirks && quirks->shift && quirks->loadIncrementIndex && !quirks->jumpWithOffset && "TestRomLibrary failed");
+	std::filesystem::remove(database_file);
+
+	Chip8 fromFile, fromMapping;
+	LoadRomIntoMemory(fromFile, ibm->Path());
+	LoadRomIntoMemory(fromMapping, ibm->Bytes());
+	assert(std::equal(fromFile.memory, fromFile.memory + MEMORY_SIZE, fromMapping.memory) && "TestRomLibrary failed");
+}
+
+// The reference must agree with itself, and a planted bug must be found on the exact instruction
+void TestDifferential() {
+	DifferentialOptions options{};
+	options.maxInstructions = 2000;
+	std::ostringstream report;
+	assert(FuzzEngines(FetchDecodeExecute, FetchDecodeExecute, 1, 50, options, report) == 0 && "TestDifferential failed");
+
+	// 7X42 adds one too many
+	const Engine buggy = [](Chip8 &chip8, const std::bitset<16> &keypad, const Params &params) {
+		const bool planted = (chip8.memory[chip8.programCounter] & 0xF0) == 0x70 &&
+			chip8.memory[chip8.programCounter + 1] == 0x42;
+		const uint8_t x = chip8.memory[chip8.programCounter] & 0xF;
+		FetchDecodeExecute(chip8, keypad, params);
+		chip8.registers[x] += planted ? 1 : 0;
+	};
+	Chip8 chip8;
+	// 6105, then 7101 a hundred times, then 7142, then jump to self
+	const uint8_t program[] = {0x61, 0x05};
+	LoadRomIntoMemory(chip8, program);
+	for (uint16_t i = 0; i < 100; i++) {
+		chip8.memory[ROM_ADDRESS_START + 2 + i * 2] = 0x71;
+		chip8.memory[ROM_ADDRESS_START + 3 + i * 2] = 0x01;
+	}
+	const uint16_t planted = ROM_ADDRESS_START + 202;
+	chip8.memory[planted] = 0x71;
+	chip8.memory[planted + 1] = 0x42;
+	chip8.memory[planted + 2] = 0x10 | ((planted + 2) >> 8);
+	chip8.memory[planted + 3] = (planted + 2) & 0xFF;
+
+	const DifferentialResult result = RunDifferential(FetchDecodeExecute, buggy, chip8, options);
+	assert(result.divergence && result.divergence->instruction == 101 && "TestDifferential failed");
+
+	// 7142 sends the candidate into the font data, whose F090 it must never decode
+	const Engine stray = [](Chip8 &chip8, const std::bitset<16> &keypad, const Params &params) {
+		const bool planted = chip8.memory[chip8.programCounter] == 0x71 && chip8.memory[chip8.programCounter + 1] == 0x42;
+		FetchDecodeExecute(chip8, keypad, params);
+		chip8.programCounter = planted ? FONT_ADDRESS_START : chip8.programCounter;
+	};
+	LoadFontsIntoMemory(chip8);
+	const DifferentialResult strayResult = RunDifferential(FetchDecodeExecute, stray, chip8, options);
+	assert(strayResult.divergence && strayResult.divergence->instruction == 101 &&
+		strayResult.divergence->candidate.programCounter == FONT_ADDRESS_START && "TestDifferential failed");
+	assert(result.divergence->before.programCounter == planted && "TestDifferential failed");
+	assert(result.divergence->reference.registers[1] + 1 == result.divergence->candidate.registers[1] &&
+		"TestDifferential failed");
+}
+
+// Records the display each session last reported
+class RecordingSink : public FrameSink {
+public:
+	void OnFrame(const uint32_t session, uint64_t, const std::bitset<2048> &display, const std::bitset<2048> &) override {
+		std::lock_guard lock(mutex);
+		displays[session] = display;
+	}
+
+	std::mutex mutex;
+	std::bitset<2048> displays[64];
+};
+
+// Sessions multiplexed over a few threads must end up where a plain headless run does
+void TestSessionScheduler(const std::string &rom_file) {
+	constexpr uint8_t ups = 120;
+	constexpr uint64_t frames = 30;
+	Chip8 initial;
+	LoadFontsIntoMemory(initial);
+	LoadRomIntoMemory(initial, rom_file);
+
+	Chip8 expected = initial;
+	RunHeadless(ups, expected, {}, frames, [](Chip8 &, std::bitset<16> &) { return true; });
+
+	const auto sink = std::make_shared<RecordingSink>();
+	SessionScheduler scheduler(3);
+	for (uint32_t i = 0; i < 64; i++) {
+		scheduler.AddSession(initial, {}, ups, sink);
+	}
+	for (uint64_t frame = 0; frame < frames; frame++) {
+		scheduler.Tick();
+		scheduler.WaitIdle();
+	}
+	for (const auto &display : sink->displays) {
+		assert(display == expected.display && "TestSessionScheduler failed");
+	}
+
+	// Stopped sessions finish on the next tick and are reaped on the one after
+	scheduler.StopSession(0);
+	scheduler.Tick();
+	scheduler.WaitIdle();
+	scheduler.Tick();
+	scheduler.WaitIdle();
+	assert(scheduler.SessionCount() == 63 && "TestSessionScheduler failed");
+}
+
+// -serve must refuse to replace anything but a stale socket
+void TestServeKeepsRegularFiles() {
+	const std::string path = "serve_test.txt";
+	{
+		std::ofstream file(path);
+		file << "notes";
+	}
+	// The child exits through exit(), which would flush a copy of anything still buffered
+	std::cout.flush();
+	const pid_t child = fork();
+	if (child == 0) {
+		// Closed stderr: the expected error message is not part of the test output
+		close(STDERR_FILENO);
+		SessionScheduler scheduler(1);
+		const std::atomic<bool> stop = true;
+		ServeUnixSocket(scheduler, path, std::span<const uint8_t>{IBM_LOGO_INSTRUCTIONS}, {}, 600, stop);
+		_exit(0);
+	}
+	int status = 0;
+	waitpid(child, &status, 0);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 1 && "TestServeKeepsRegularFiles failed");
+	std::ifstream file(path);
+	std::string contents;
+	file >> contents;
+	assert(contents == "notes" && "TestServeKeepsRegularFiles failed");
+	std::filesystem::remove(path);
+}
+
+// A client that stops reading must not block the worker: frames are dropped, then one full frame resynchronises it
+void TestFdFrameSinkBackpressure() {
+	int fds[2];
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0 && "TestFdFrameSinkBackpressure failed");
+	FdFrameSink sink(fds[0]);
+	std::bitset<2048> display, changed;
+	changed.set();
+
+	// Several megabytes of full frames into a socket nobody reads
+	uint64_t frame = 0;
+	for (; frame < 20000; frame++) {
+		display.flip();
+		sink.OnFrame(7, frame, display, changed);
+	}
+
+	// Drain the client side and parse messages until one sent after the stall arrives
+	std::vector<uint8_t> stream;
+	std::vector<std::pair<uint64_t, uint32_t>> messages;
+	const uint64_t firstAfterStall = frame;
+	changed.reset();
+	changed.set(64);
+	size_t afterStall = 0;
+	while (afterStall < 2) {
+		uint8_t buffer[4096];
+		ssize_t result;
+		while ((result = recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+			stream.insert(stream.end(), buffer, buffer + result);
+		}
+		size_t offset = 0;
+		while (stream.size() - offset >= 16) {
+			uint32_t session = 0, mask = 0;
+			uint64_t number = 0;
+			for (int i = 0; i < 4; i++) {
+				session |= stream[offset + i] << (i * 8);
+				mask |= static_cast<uint32_t>(stream[offset + 12 + i]) << (i * 8);
+			}
+			for (int i = 0; i < 8; i++) {
+				number |= static_cast<uint64_t>(stream[offset + 4 + i]) << (i * 8);
+			}
+			const size_t length = 16 + std::popcount(mask) * 8;
+			if (stream.size() - offset < length) {
+				break;
+			}
+			assert(session == 7 && "TestFdFrameSinkBackpressure failed");
+			assert((messages.empty() || number > messages.back().first) && "TestFdFrameSinkBackpressure failed");
+			messages.emplace_back(number, mask);
+			afterStall += number >= firstAfterStall;
+			offset += length;
+		}
+		stream.erase(stream.begin(), stream.begin() + offset);
+		sink.OnFrame(7, frame++, display, changed);
+	}
+
+	// Frames were dropped, the first one after the stall carries every row and the next one only the changed row
+	assert(messages.size() < firstAfterStall && "TestFdFrameSinkBackpressure failed");
+	const auto resync = std::find_if(messages.begin(), messages.end(),
+		[firstAfterStall](const auto &message) { return message.first >= firstAfterStall; });
+	assert(resync->second == 0xFFFFFFFF && "TestFdFrameSinkBackpressure failed");
+	assert(messages.back().second == 0b10 && "TestFdFrameSinkBackpressure failed");
+	close(fds[1]);
+}
+
+// Readers must never see a frame that is half old and half new, and injected keys must reach the emulator
+void TestSharedFrame() {
+	const std::string name = "/chip8_test_" + std::to_string(getpid());
+	SharedFrameExport shared(name);
+	SharedFrameView view(name);
+	assert(view.IsOpen() && "TestSharedFrame failed");
+
+	view.Inject(0b1010);
+	assert(shared.InjectedKeypad() == 0b1010 && "TestSharedFrame failed");
+
+	// Odd frames are all white, even frames all black, the delay timer carries the frame number
+	constexpr uint64_t frames = 20000;
+	std::thread writer([&shared] {
+		Chip8 chip8;
+		for (uint64_t frame = 1; frame <= frames; frame++) {
+			frame % 2 ? chip8.display.set() : chip8.display.reset();
+			chip8.delayTimer = frame & 0xFF;
+			shared.Publish(chip8, frame & 0xFFFF, frame);
+		}
+	});
+	uint64_t last = 0;
+	while (last < frames) {
+		// A busy writer may outlast the read attempts, that is not a torn frame
+		const std::optional<SharedFrameSnapshot> read = view.Read();
+		if (!read || read->frame == 0) {
+			continue;
+		}
+		const SharedFrameSnapshot &snapshot = *read;
+		assert(snapshot.frame >= last && "TestSharedFrame failed");
+		assert(snapshot.display.count() == (snapshot.frame % 2 ? 2048 : 0) && "TestSharedFrame failed");
+		assert(snapshot.delayTimer == (snapshot.frame & 0xFF) && "TestSharedFrame failed");
+		assert(snapshot.keypad.to_ulong() == (snapshot.frame & 0xFFFF) && "TestSharedFrame failed");
+		last = snapshot.frame;
+	}
+	writer.join();
+
+	// A writer that died mid-publish leaves the sequence odd, readers must give up instead of spinning forever
+	const int fd = shm_open(name.c_str(), O_RDWR, 0);
+	auto *segment = static_cast<SharedFrame *>(mmap(nullptr, sizeof(SharedFrame), PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0));
+	close(fd);
+	assert(segment != MAP_FAILED && "TestSharedFrame failed");
+	segment->sequence.fetch_add(1);
+	assert(!view.Read() && "TestSharedFrame failed");
+	segment->sequence.fetch_add(1);
+	assert(view.Read() && view.Read()->frame == frames && "TestSharedFrame failed");
+	munmap(segment, sizeof(SharedFrame));
+
+	// A viewer attaching between the creator's shm_open and ftruncate must not map the empty object
+	const std::string unsized = name + "_unsized";
+	const int unsizedFd = shm_open(unsized.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	assert(unsizedFd >= 0 && "TestSharedFrame failed");
+	assert(!SharedFrameView(unsized).IsOpen() && "TestSharedFrame failed");
+	close(unsizedFd);
+	shm_unlink(unsized.c_str());
+}
+
 int main() {
     Chip8 chip8;
 
     TestLoadRomIntoMemory(chip8, "../roms/1-chip8-logo.ch8", CHIP8_LOGO_INSTRUCTIONS);
     TestLoadRomIntoMemory(chip8, "../roms/2-ibm-logo.ch8", IBM_LOGO_INSTRUCTIONS);
 	std::cout << "TestLoadRomIntoMemory() succeeded" << "\n";
+
+	TestOutOfRangeAccess();
+	std::cout << "TestOutOfRangeAccess() succeeded" << "\n";
+
+	TestOversizedRom();
+	std::cout << "TestOversizedRom() succeeded" << "\n";
+
+	TestCaptureDeduplication();
+	std::cout << "TestCaptureDeduplication() succeeded" << "\n";
+
+	TestCapturePng();
+	std::cout << "TestCapturePng() succeeded" << "\n";
+
+	TestCaptureY4m();
+	std::cout << "TestCaptureY4m() succeeded" << "\n";
+
+	TestCaptureUnknownInstruction();
+	std::cout << "TestCaptureUnknownInstruction() succeeded" << "\n";
+
+	TestLatencyTracker();
+	std::cout << "TestLatencyTracker() succeeded" << "\n";
+
+	TestRomLibrary("../roms");
+	std::cout << "TestRomLibrary() succeeded" << "\n";
+
+	TestDifferential();
+	std::cout << "TestDifferential() succeeded" << "\n";
+
+	TestSessionScheduler("../roms/2-ibm-logo.ch8");
+	std::cout << "TestSessionScheduler() succeeded" << "\n";
+
+	TestFdFrameSinkBackpressure();
+	std::cout << "TestFdFrameSinkBackpressure() succeeded" << "\n";
+
+	TestServeKeepsRegularFiles();
+	std::cout << "TestServeKeepsRegularFiles() succeeded" << "\n";
+
+	TestSharedFrame();
+	std::cout << "TestSharedFrame() succeeded" << "\n";
 }